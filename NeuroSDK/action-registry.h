@@ -0,0 +1,435 @@
+#pragma once
+// The registered actions, shared between the game thread (which registers and unregisters) and
+// whichever thread dispatches incoming actions.
+//
+// Dispatch never takes a lock.  The name -> action map is split into shards by hash, and each
+// shard is immutable once published: a change copies the shards it touches, edits the copies and
+// swaps their pointers, so a lookup is a hash probe in whatever version of its shard it picked up
+// and a write costs the size of a shard, not of the whole registry.  The shard count doubles as
+// the registry grows to keep shards small.  The old shards, and any action taken out, can't be
+// freed while a dispatch might still be looking at them; that is tracked with epochs.  A dispatch
+// marks its thread busy with the current epoch for as long as it holds a lookup (a ReadGuard), and
+// whatever a writer retires is only deleted once every busy thread has moved past the epoch it was
+// retired in, by the next write or by the last guard out.  An onAction() that unregisters its own
+// action is fine: the action is deleted after the guard is gone.
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace neuro {
+
+class Action;
+
+// Threads that read registries, one slot each (shared by every registry in the process).
+// Slots come in blocks; a thread that finds them all taken links another block on the end.
+class EpochDomain {
+public:
+    static constexpr size_t slotsPerBlock = 64;
+    static constexpr uint64_t idle = 0;
+
+    static EpochDomain &instance() {
+        static EpochDomain domain;
+        return domain;
+    }
+
+    ~EpochDomain() {
+        Block *block = first.next.load();
+        while (block) {
+            Block *next = block->next.load();
+            delete block;
+            block = next;
+        }
+    }
+
+    // Wait-free apart from a thread's very first call, which has to find itself a slot
+    void enter() {
+        ThreadSlot &self = threadSlot();
+        if (self.depth++ == 0) {
+            self.slot->store(epoch.load());
+        }
+    }
+
+    // True when that was the thread's outermost guard
+    bool leave() {
+        ThreadSlot &self = threadSlot();
+        if (--self.depth == 0) {
+            self.slot->store(idle);
+            return true;
+        }
+        return false;
+    }
+
+    // Move the epoch on, returning the one whatever was just unpublished belongs to
+    uint64_t advance() { return epoch.fetch_add(1); }
+
+    // The oldest epoch a reader might still be in, things retired before it can go
+    uint64_t oldestActive() const {
+        uint64_t oldest = epoch.load();
+        for (const Block *block = &first; block; block = block->next.load()) {
+            for (const auto &slot : block->slots) {
+                uint64_t seen = slot.epoch.load();
+                if (seen != idle && seen < oldest) oldest = seen;
+            }
+        }
+        return oldest;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch{ idle };
+        std::atomic<bool> taken{ false };
+    };
+
+    // Blocks are only ever added, so a slot stays put for as long as the domain lives
+    struct Block {
+        Slot slots[slotsPerBlock];
+        std::atomic<Block*> next{ nullptr };
+    };
+
+    // A thread's claim on a slot, given back when the thread exits
+    struct ThreadSlot {
+        std::atomic<uint64_t> *slot = nullptr;
+        std::atomic<bool> *taken = nullptr;
+        unsigned depth = 0;
+
+        ~ThreadSlot() {
+            if (taken) taken->store(false);
+        }
+    };
+
+    ThreadSlot &threadSlot() {
+        thread_local ThreadSlot self;
+        if (!self.slot) {
+            Block *block = &first;
+            while (!claim(*block, self)) {
+                Block *next = block->next.load();
+                if (!next) {
+                    // Every slot is taken, add a block.  Whoever loses the race uses the winner's.
+                    Block *added = new Block();
+                    if (block->next.compare_exchange_strong(next, added)) {
+                        next = added;
+                    } else {
+                        delete added;
+                    }
+                }
+                block = next;
+            }
+        }
+        return self;
+    }
+
+    static bool claim(Block &block, ThreadSlot &self) {
+        for (auto &slot : block.slots) {
+            bool expected = false;
+            if (slot.taken.compare_exchange_strong(expected, true)) {
+                self.slot = &slot.epoch;
+                self.taken = &slot.taken;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::atomic<uint64_t> epoch{ 1 };
+    Block first;
+};
+
+// Templated on the key only because ActionKey needs Action, which needs this header first;
+// neuro-sdk.hpp names the one instance that is used, ActionRegistry.
+template<typename Key, typename Hash>
+class ActionRegistryT {
+public:
+    using Map = std::unordered_map<Key, Action*, Hash>;
+
+    // Hold one for as long as anything found with find() is in use.  Given the registry, the last
+    // guard out on a thread also frees whatever the registry retired meanwhile, if no write is under way.
+    class ReadGuard {
+    public:
+        ReadGuard() { EpochDomain::instance().enter(); }
+        explicit ReadGuard(ActionRegistryT &registry) : registry(&registry) { EpochDomain::instance().enter(); }
+        ~ReadGuard() {
+            if (EpochDomain::instance().leave() && registry) registry->reclaimIdle();
+        }
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+    private:
+        ActionRegistryT *registry = nullptr;
+    };
+
+    // deleter frees an action once nobody can be using it any more
+    explicit ActionRegistryT(std::function<void(Action*)> deleter) : deleteAction(std::move(deleter)), current(newTable(initialShards)) {}
+
+    // Nothing may be reading by now
+    ~ActionRegistryT() {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        for (auto &item : retired) {
+            free(item);
+        }
+        const Table *table = current.load();
+        for (size_t i = 0; i <= table->mask; i++) {
+            const Map *map = table->shards[i].load();
+            for (const auto &entry : *map) {
+                deleteAction(entry.second);
+            }
+            delete map;
+        }
+        delete table;
+    }
+
+    // Lock free, only valid inside a ReadGuard
+    Action *find(std::string_view name) const {
+        Key key(name);
+        const Table *table = current.load();
+        const Map *map = table->shards[shardOf(key, table->mask)].load();
+        auto it = map->find(key);
+        return it == map->end() ? nullptr : it->second;
+    }
+
+    // Add actions whose names aren't taken yet (in one new version of each shard touched), the ones
+    // added go in added
+    void add(const std::vector<Action*> &actions, std::vector<Action*> *added) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        Edits edits;
+        for (Action *action : actions) {
+            Key key(*action);
+            if (edit(edits, key).emplace(key, action).second) {
+                count++;
+                if (added) added->push_back(action);
+            }
+        }
+        publish(edits);
+        grow();
+        reclaim();
+    }
+
+    // Take the named actions out (in one new version of each shard touched).  The ones removed are
+    // handed to onRemove straight away but only deleted once no dispatch can still be using them.
+    size_t remove(const std::vector<std::string> &names, const std::function<void(Action*)> &onRemove) {
+        std::unique_lock<std::mutex> lock(writeMutex);
+        Edits edits;
+        std::vector<Action*> removed;
+        for (const std::string &name : names) {
+            Key key(name);
+            if (!contains(key)) continue;
+            Map &map = edit(edits, key);
+            auto it = map.find(key);
+            if (it == map.end()) continue;  // Named twice
+            removed.push_back(it->second);
+            map.erase(it);
+        }
+        if (removed.empty()) return 0;
+        count -= removed.size();
+        uint64_t epoch = publish(edits);
+
+        // Not under the lock, the callback may well register or unregister something else.
+        // The actions are only retired afterwards so no other writer can delete them under it.
+        lock.unlock();
+        for (Action *action : removed) {
+            onRemove(action);
+        }
+        lock.lock();
+        for (Action *action : removed) {
+            retire({ epoch, nullptr, nullptr, action });
+        }
+        reclaim();
+        return removed.size();
+    }
+
+    // Take actions back out without deleting them, for ones that were never announced and so can't
+    // have been dispatched.  The caller owns them again.
+    void take(const std::vector<Action*> &actions) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        Edits edits;
+        for (Action *action : actions) {
+            Key key(*action);
+            if (!contains(key, action)) continue;
+            edit(edits, key).erase(key);
+            count--;
+        }
+        publish(edits);
+        reclaim();
+    }
+
+    // A snapshot of what is registered right now (for the registering side, not for dispatch)
+    std::vector<Action*> list() const {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        const Table *table = current.load();
+        std::vector<Action*> actions;
+        actions.reserve(count);
+        for (size_t i = 0; i <= table->mask; i++) {
+            for (const auto &entry : *table->shards[i].load()) {
+                actions.push_back(entry.second);
+            }
+        }
+        return actions;
+    }
+
+    bool empty() const {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        return count == 0;
+    }
+
+    // Actions waiting on a reader before they can be deleted
+    size_t pendingReclaim() const {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        return retired.size();
+    }
+
+    ActionRegistryT(const ActionRegistryT&) = delete;
+    ActionRegistryT& operator=(const ActionRegistryT&) = delete;
+
+private:
+    static constexpr size_t initialShards = 4;
+    static constexpr size_t shardTarget = 16;  // Entries per shard before the shard count doubles
+
+    // The shards, a power of two of them.  The table itself only changes when it is replaced by a
+    // bigger one; a write swaps single shard pointers in the current table.
+    struct Table {
+        size_t mask;
+        std::unique_ptr<std::atomic<const Map*>[]> shards;
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        const Table *table;
+        const Map *map;
+        Action *action;
+    };
+
+    // The shard copies one write is making, by shard index
+    using Edits = std::unordered_map<size_t, std::unique_ptr<Map>>;
+
+    static Table *newTable(size_t shards) {
+        std::vector<std::unique_ptr<Map>> maps(shards);
+        for (auto &map : maps) {
+            map.reset(new Map());
+        }
+        return newTable(maps);
+    }
+
+    static Table *newTable(std::vector<std::unique_ptr<Map>> &maps) {
+        Table *table = new Table{ maps.size() - 1, std::unique_ptr<std::atomic<const Map*>[]>(new std::atomic<const Map*>[maps.size()]) };
+        for (size_t i = 0; i < maps.size(); i++) {
+            table->shards[i].store(maps[i].release());
+        }
+        return table;
+    }
+
+    // The top bits of a multiplicative hash, so the shard doesn't follow the buckets inside it
+    static size_t shardOf(const Key &key, size_t mask) {
+        uint64_t mixed = (uint64_t)Hash()(key) * 0x9E3779B97F4A7C15ull;
+        return (size_t)(mixed >> 32) & mask;
+    }
+
+    // This write's copy of the key's shard, made the first time it is needed (writer lock held)
+    Map &edit(Edits &edits, const Key &key) {
+        const Table *table = current.load();
+        size_t index = shardOf(key, table->mask);
+        std::unique_ptr<Map> &copy = edits[index];
+        if (!copy) copy.reset(new Map(*table->shards[index].load()));
+        return *copy;
+    }
+
+    // Registered right now, as that action if one is given (writer lock held)
+    bool contains(const Key &key, const Action *action = nullptr) const {
+        const Table *table = current.load();
+        const Map *map = table->shards[shardOf(key, table->mask)].load();
+        auto it = map->find(key);
+        return it != map->end() && (!action || it->second == action);
+    }
+
+    // Swap the edited shards in, then retire the old ones with the epoch that was current before
+    // the swap (which is returned); anyone reading an old shard entered no later than that.
+    // Writer lock held.
+    uint64_t publish(Edits &edits) {
+        if (edits.empty()) return 0;
+        const Table *table = current.load();
+        std::vector<const Map*> previous;
+        previous.reserve(edits.size());
+        for (auto &edit : edits) {
+            previous.push_back(table->shards[edit.first].exchange(edit.second.release()));
+        }
+        uint64_t epoch = EpochDomain::instance().advance();
+        for (const Map *map : previous) {
+            retire({ epoch, nullptr, map, nullptr });
+        }
+        return epoch;
+    }
+
+    // Double the shards while they are above target, rehashing into a new table (writer lock held)
+    void grow() {
+        const Table *table = current.load();
+        size_t shards = table->mask + 1;
+        if (count <= shards * shardTarget) return;
+        while (count > shards * shardTarget) shards *= 2;
+
+        std::vector<std::unique_ptr<Map>> maps(shards);
+        for (auto &map : maps) {
+            map.reset(new Map());
+            map->reserve(shardTarget);
+        }
+        for (size_t i = 0; i <= table->mask; i++) {
+            for (const auto &entry : *table->shards[i].load()) {
+                maps[shardOf(entry.first, shards - 1)]->insert(entry);
+            }
+        }
+        current.store(newTable(maps));
+        uint64_t epoch = EpochDomain::instance().advance();
+        for (size_t i = 0; i <= table->mask; i++) {
+            retire({ epoch, nullptr, table->shards[i].load(), nullptr });
+        }
+        retire({ epoch, table, nullptr, nullptr });
+    }
+
+    void retire(const Retired &item) {
+        retired.push_back(item);
+        retiredCount.store(retired.size(), std::memory_order_relaxed);
+    }
+
+    // Delete whatever no reader can still see (writer lock held)
+    void reclaim() {
+        uint64_t oldest = EpochDomain::instance().oldestActive();
+        size_t kept = 0;
+        for (size_t i = 0; i < retired.size(); i++) {
+            if (retired[i].epoch < oldest) {
+                free(retired[i]);
+            } else {
+                retired[kept++] = retired[i];
+            }
+        }
+        retired.resize(kept);
+        retiredCount.store(kept, std::memory_order_relaxed);
+    }
+
+    // From a reader on its way out: only worth the lock when something is waiting, and never
+    // waited for, a writer reclaims when it is done anyway
+    void reclaimIdle() {
+        if (retiredCount.load(std::memory_order_relaxed) == 0) return;
+        std::unique_lock<std::mutex> lock(writeMutex, std::try_to_lock);
+        if (lock) reclaim();
+    }
+
+    void free(const Retired &item) {
+        delete item.table;
+        delete item.map;
+        if (item.action) deleteAction(item.action);
+    }
+
+    std::function<void(Action*)> deleteAction;
+    mutable std::mutex writeMutex;  // Writers only, lookups never touch it
+    std::atomic<const Table*> current;
+    size_t count = 0;
+    std::vector<Retired> retired;
+    std::atomic<size_t> retiredCount{ 0 };
+};
+
+}
@@ -0,0 +1,264 @@
+#pragma once
+// A small epoll based event loop (Linux only).
+//
+// Instead of parking a thread in a blocking recv() per connection, sockets are registered
+// with the loop along with a callback that is run when they become ready.  Work from other
+// threads is handed over with post(), which wakes the loop through an eventfd, so the loop
+// can always be interrupted for shutdown, timers or outbound work.
+
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace neuro {
+
+class EventLoop {
+public:
+    using IoCallback = std::function<void(uint32_t events)>;
+    using Task = std::function<void()>;
+    using TimerId = uint64_t;
+    using Clock = std::chrono::steady_clock;
+
+    EventLoop() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) {
+            throw std::runtime_error("epoll_create1 failed");
+        }
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeFd < 0) {
+            ::close(epollFd);
+            throw std::runtime_error("eventfd failed");
+        }
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+    }
+
+    ~EventLoop() {
+        ::close(wakeFd);
+        ::close(epollFd);
+    }
+
+    // Watch a file descriptor, the callback receives the epoll event mask.
+    // Must be called on the loop thread (use post() from anywhere else).
+    bool add(int fd, uint32_t events, IoCallback callback) {
+        struct epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            return false;
+        }
+        handlers[fd] = std::make_shared<IoCallback>(std::move(callback));
+        return true;
+    }
+
+    // Change the events we are interested in for a watched descriptor (loop thread only)
+    bool modify(int fd, uint32_t events) {
+        struct epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+        return epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev) == 0;
+    }
+
+    // Stop watching a descriptor (loop thread only).  Safe to call from inside its own callback.
+    void remove(int fd) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        handlers.erase(fd);
+    }
+
+    // Queue a task to run on the loop thread, safe to call from any thread.
+    void post(Task task) {
+        {
+            std::lock_guard<std::mutex> lock(taskMutex);
+            tasks.push_back(std::move(task));
+        }
+        wakeup();
+    }
+
+    // Run a task now if we are already on the loop thread, otherwise post it.
+    void dispatch(Task task) {
+        if (isInLoopThread()) {
+            task();
+        } else {
+            post(std::move(task));
+        }
+    }
+
+    // Run a task after a delay, repeating every interval if one is given.
+    // Safe to call from any thread; the returned id can be passed to cancelTimer().
+    TimerId addTimer(std::chrono::milliseconds delay, Task task, std::chrono::milliseconds interval = std::chrono::milliseconds(0)) {
+        TimerId id = nextTimerId++;
+        auto timer = std::make_shared<Timer>(Timer{ id, Clock::now() + delay, interval, std::move(task) });
+        dispatch([this, timer]() {
+            timers[timer->id] = timer;
+            timerQueue.emplace(timer->deadline, timer->id);
+        });
+        return id;
+    }
+
+    void cancelTimer(TimerId id) {
+        dispatch([this, id]() { timers.erase(id); });
+    }
+
+    // Run until stop() is called
+    void run() {
+        loopThread = std::this_thread::get_id();
+        while (!stopRequested) {
+            runOnce(-1);
+        }
+        stopRequested = false;
+        loopThread = std::thread::id();
+    }
+
+    // Wait for (at most timeoutMs, -1 for forever) and process one batch of events
+    void runOnce(int timeoutMs) {
+        if (loopThread == std::thread::id()) {
+            loopThread = std::this_thread::get_id();
+        }
+
+        int waitMs = nextTimerTimeout(timeoutMs);
+        struct epoll_event events[64];
+        int count = epoll_wait(epollFd, events, 64, waitMs);
+        if (count < 0 && errno != EINTR) {
+            throw std::runtime_error("epoll_wait failed");
+        }
+
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wakeFd) {
+                uint64_t value;
+                while (::read(wakeFd, &value, sizeof(value)) > 0) {}
+                continue;
+            }
+            // Look the handler up per event, an earlier callback may have removed it
+            auto it = handlers.find(fd);
+            if (it == handlers.end()) continue;
+            std::shared_ptr<IoCallback> handler = it->second;
+            (*handler)(events[i].events);
+        }
+
+        runTimers();
+        runTasks();
+    }
+
+    // Ask the loop to return from run(), safe to call from any thread
+    void stop() {
+        stopRequested = true;
+        wakeup();
+    }
+
+    bool isInLoopThread() const {
+        return loopThread == std::this_thread::get_id();
+    }
+
+    // Disallow copy and asignment operators
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+private:
+    struct Timer {
+        TimerId id;
+        Clock::time_point deadline;
+        std::chrono::milliseconds interval;
+        Task task;
+    };
+
+    void wakeup() {
+        uint64_t one = 1;
+        ssize_t res = ::write(wakeFd, &one, sizeof(one));
+        (void)res;  // EAGAIN just means a wakeup is already pending
+    }
+
+    int nextTimerTimeout(int timeoutMs) {
+        {
+            std::lock_guard<std::mutex> lock(taskMutex);
+            if (!tasks.empty()) return 0;
+        }
+        // Drop cancelled timers from the front of the queue
+        while (!timerQueue.empty() && timers.find(timerQueue.begin()->second) == timers.end()) {
+            timerQueue.erase(timerQueue.begin());
+        }
+        if (timerQueue.empty()) return timeoutMs;
+
+        auto untilNext = std::chrono::duration_cast<std::chrono::milliseconds>(timerQueue.begin()->first - Clock::now()).count();
+        if (untilNext < 0) untilNext = 0;
+        if (timeoutMs >= 0 && timeoutMs < untilNext) return timeoutMs;
+        // Round up so we don't spin for the last partial millisecond
+        return (int)untilNext + 1;
+    }
+
+    void runTimers() {
+        auto now = Clock::now();
+        while (!timerQueue.empty() && timerQueue.begin()->first <= now) {
+            TimerId id = timerQueue.begin()->second;
+            timerQueue.erase(timerQueue.begin());
+            auto it = timers.find(id);
+            if (it == timers.end()) continue;  // Cancelled
+
+            std::shared_ptr<Timer> timer = it->second;
+            if (timer->interval.count() > 0) {
+                timer->deadline = now + timer->interval;
+                timerQueue.emplace(timer->deadline, id);
+            } else {
+                timers.erase(it);
+            }
+            timer->task();
+        }
+    }
+
+    void runTasks() {
+        std::vector<Task> pending;
+        {
+            std::lock_guard<std::mutex> lock(taskMutex);
+            pending.swap(tasks);
+        }
+        for (auto& task : pending) {
+            task();
+        }
+    }
+
+    int epollFd = -1;
+    int wakeFd = -1;
+    std::atomic_bool stopRequested{ false };
+    std::atomic<std::thread::id> loopThread{ std::thread::id() };
+
+    std::mutex taskMutex;
+    std::vector<Task> tasks;
+
+    std::atomic<TimerId> nextTimerId{ 1 };
+    std::unordered_map<TimerId, std::shared_ptr<Timer>> timers;
+    std::multimap<Clock::time_point, TimerId> timerQueue;
+
+    std::unordered_map<int, std::shared_ptr<IoCallback>> handlers;
+};
+
+}
+
+#else
+
+namespace neuro {
+
+// Elsewhere there is no loop to run (useEventLoop falls back to a receive thread), but the SDK
+// still holds a pointer to one, so the type has to be complete
+class EventLoop {};
+
+}
+
+#endif // __linux__
@@ -0,0 +1,201 @@
+#pragma once
+// Threads to run action handlers on, so a slow onAction() doesn't hold up the connection.
+//
+// Each worker has a queue of its own.  A worker takes its newest task first and, once it has run
+// dry, steals the oldest from another worker; a task posted by a worker goes on its own queue, one
+// posted from outside (the receive thread) is dealt round the workers.  Tasks that must not
+// overlap or overtake each other share a key: tasks with the same key run one at a time, in the
+// order they were posted, on whichever worker is free.  Tasks with different keys run in parallel.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace neuro {
+
+class HandlerPool {
+public:
+    using Task = std::function<void()>;
+
+    // Run threads workers, 0 picks one per core
+    explicit HandlerPool(unsigned threads = 0) {
+        if (threads == 0) {
+            threads = (std::max)(1u, std::thread::hardware_concurrency());
+        }
+        workers.reserve(threads);
+        for (unsigned i = 0; i < threads; i++) {
+            workers.emplace_back(new Worker());
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            workers[i]->thread = std::thread([this, i]() { runWorker(i); });
+        }
+    }
+
+    // Runs everything already posted, then stops the workers
+    ~HandlerPool() {
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            stopping = true;
+        }
+        idleWake.notify_all();
+        for (auto &worker : workers) {
+            if (worker->thread.joinable()) worker->thread.join();
+        }
+    }
+
+    // Run task on any worker, in no particular order
+    void post(Task task) {
+        schedule(std::move(task));
+    }
+
+    // Run task after every task posted earlier with the same key has finished
+    void post(const std::string &key, Task task) {
+        std::lock_guard<std::mutex> lock(strandMutex);
+        Strand &strand = strands[key];
+        strand.tasks.push_back(std::move(task));
+        if (!strand.scheduled) {
+            strand.scheduled = true;
+            schedule([this, key]() { runStrand(key); });
+        }
+    }
+
+    size_t threadCount() const { return workers.size(); }
+
+    // Disallow copy and asignment operators
+    HandlerPool(const HandlerPool&) = delete;
+    HandlerPool& operator=(const HandlerPool&) = delete;
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::thread thread;
+    };
+
+    // The tasks waiting on one key; scheduled while a worker has (or is about to have) its runner
+    struct Strand {
+        std::deque<Task> tasks;
+        bool scheduled = false;
+    };
+
+    // Which of our workers the calling thread is, if any
+    struct Current {
+        const HandlerPool *pool = nullptr;
+        size_t index = 0;
+    };
+    static Current &current() {
+        thread_local Current self;
+        return self;
+    }
+
+    void schedule(Task task) {
+        Current &self = current();
+        size_t index = self.pool == this ? self.index : nextWorker++ % workers.size();
+        // Counted before it is queued, so it can't be taken (and uncounted) first
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            pending++;
+        }
+        {
+            std::lock_guard<std::mutex> lock(workers[index]->mutex);
+            workers[index]->tasks.push_back(std::move(task));
+        }
+        idleWake.notify_one();
+    }
+
+    // Our own newest task, or else the oldest one of someone else's
+    bool take(size_t index, Task &task) {
+        {
+            Worker &own = *workers[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < workers.size(); i++) {
+            Worker &victim = *workers[(index + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void runWorker(size_t index) {
+        current() = { this, index };
+        Task task;
+        while (true) {
+            if (take(index, task)) {
+                {
+                    std::lock_guard<std::mutex> lock(idleMutex);
+                    pending--;
+                }
+                try {
+                    task();
+                } catch (const std::exception &e) {
+                    std::cerr << "Error in action handler: " << e.what() << std::endl;
+                }
+                task = nullptr;
+                continue;
+            }
+            // Pending counts tasks posted but not yet taken, so one being pushed or stolen elsewhere
+            // can keep us round the loop briefly, but one still queued can never be slept through
+            std::unique_lock<std::mutex> lock(idleMutex);
+            idleWake.wait(lock, [this]() { return pending > 0 || stopping; });
+            if (stopping && pending == 0) break;
+        }
+    }
+
+    // Run the key's oldest task, then queue the runner again if more have come in meanwhile.
+    // One task per turn, so a busy key can't keep a worker from everything else on its queue.
+    void runStrand(const std::string &key) {
+        Task task;
+        {
+            std::lock_guard<std::mutex> lock(strandMutex);
+            Strand &strand = strands[key];
+            task = std::move(strand.tasks.front());
+            strand.tasks.pop_front();
+        }
+        try {
+            task();
+        } catch (const std::exception &e) {
+            std::cerr << "Error in action handler: " << e.what() << std::endl;
+        }
+        std::lock_guard<std::mutex> lock(strandMutex);
+        auto it = strands.find(key);
+        if (it->second.tasks.empty()) {
+            strands.erase(it);
+        } else {
+            schedule([this, key]() { runStrand(key); });
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> nextWorker{ 0 };
+
+    std::mutex idleMutex;
+    std::condition_variable idleWake;
+    size_t pending = 0;
+    bool stopping = false;
+
+    std::mutex strandMutex;
+    std::unordered_map<std::string, Strand> strands;
+};
+
+}
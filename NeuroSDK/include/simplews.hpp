@@ -2,22 +2,63 @@
 #define WEBSOCKET_HPP
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <random>
 #include <iostream>
 #include <cstdio>
 #include <functional>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <climits>
+#include <cstdint>
+#include <algorithm>
+
+#include "wsframe.hpp"
+#include "wsdeflate.hpp"
+#include "wshandshake.hpp"
+#include "wssocket.hpp"
+#ifdef SIMPLEWS_WITH_URING
+#include "wsuring.hpp"
+#endif
 
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #pragma comment(lib, "ws2_32.lib")
-#elif
+#else
 // Socket headers for linux
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+
+// Map the handful of winsock names we use onto their posix equivalents
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define SD_SEND SHUT_WR
+#define closesocket(s) ::close(s)
+#define ZeroMemory(p, n) memset((p), 0, (n))
+#endif
+
+#ifdef _WIN32
+typedef WSAPOLLFD SIMPLEWS_POLLFD;
+#define SIMPLEWS_POLL WSAPoll
+#else
+typedef struct pollfd SIMPLEWS_POLLFD;
+#define SIMPLEWS_POLL ::poll
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // Windows doesn't raise SIGPIPE in the first place
 #endif
 
 
@@ -34,9 +75,261 @@ public:
 
     using MessageCallback = std::function<void(const std::string&)>;
 
+    // A received message, pointing straight into the receive buffer (or the reassembly/inflate
+    // buffer).  Only valid until the callback returns or the next receive, retain() to keep it.
+    struct Message {
+        std::string_view payload;
+        Opcode opcode;
+
+        std::string retain() const { return std::string(payload); }
+    };
+    using MessageViewCallback = std::function<void(const Message&)>;
+
 private:
-    SOCKET socket_fd = INVALID_SOCKET;
+    // Atomic because close() and interrupt() read it to shut the socket down without send_mutex
+    // (that is how they get a stalled sender to let go of it), while connect() may be setting it
+    std::atomic<SOCKET> socket_fd{ INVALID_SOCKET };
     MessageCallback on_message;
+    MessageViewCallback on_message_view;
+    bool non_blocking = false;
+
+    // Incoming bytes and the frames parsed out of them
+    simplews::FrameDecoder decoder;
+    std::string message;  // Reused to hand messages to on_message (the copying callback) without reallocating
+
+    // Fragmented messages are put back together here; the buffer keeps its capacity between messages
+    std::string fragments;
+    Opcode fragment_opcode = Opcode::TEXT;
+    bool in_fragment = false;
+    size_t max_message_size = 16 * 1024 * 1024;
+
+    // The last complete message, pointing either into the receive buffer or at fragments
+    const char* message_data = nullptr;
+    size_t message_length = 0;
+    Opcode message_opcode = Opcode::TEXT;
+
+    // Outgoing messages longer than this are split into fragments (0 = never split)
+    size_t fragment_size = 0;
+
+    // permessage-deflate, if the server agreed to it
+    simplews::PerMessageDeflate deflate;
+    std::string deflate_out;            // Compressed outgoing message (guarded by send_mutex)
+    std::string inflate_out;            // Decompressed incoming message
+    bool fragment_compressed = false;   // RSV1 was set on the first fragment
+
+    // Keepalive and round trip times.  Pings carry the time they were sent, so the pong tells us
+    // the round trip without having to remember anything.  Times are steady_clock nanoseconds.
+    std::atomic<int64_t> last_activity{ 0 };      // Last time anything arrived from the server
+    std::atomic<int64_t> last_rtt{ -1 };          // Most recent sample
+    std::atomic<int64_t> smoothed_rtt{ -1 };      // RFC 6298 style SRTT
+    std::atomic<int64_t> rtt_variation{ 0 };      // and RTTVAR, which we report as jitter
+    std::atomic<uint64_t> rtt_samples{ 0 };
+
+    static int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void record_rtt(int64_t sample) {
+        last_rtt = sample;
+        int64_t srtt = smoothed_rtt;
+        if (srtt < 0) {
+            smoothed_rtt = sample;
+            rtt_variation = sample / 2;
+        } else {
+            int64_t difference = sample > srtt ? sample - srtt : srtt - sample;
+            rtt_variation = rtt_variation - rtt_variation / 4 + difference / 4;
+            smoothed_rtt = srtt - srtt / 8 + sample / 8;
+        }
+        rtt_samples++;
+    }
+
+    // Hand the socket to io_uring once connected (only if built with SIMPLEWS_WITH_URING)
+    bool use_uring = false;
+#ifdef SIMPLEWS_WITH_URING
+    simplews::UringTransport uring;
+#endif
+
+    // Outgoing frames.  The masked payload is built in a scratch buffer that only ever grows,
+    // so sending a message that fits in it doesn't allocate.
+    std::mutex send_mutex;
+    std::vector<uint8_t> tx_buffer;
+    // Whole frames for send_batch(), also kept around between calls
+    std::vector<uint8_t> tx_batch;
+    // Frames queued without waiting (queue_batch() and, in non-blocking mode, control frames) that
+    // the socket hasn't taken yet; tx_pending_sent of them have gone.  Always written before anything else.
+    std::vector<uint8_t> tx_pending;
+    size_t tx_pending_sent = 0;
+    std::mt19937 mask_generator{ std::random_device{}() };
+
+    // Subprotocols offered in the handshake, most preferred first, and the one the server picked
+    // (empty if it picked none)
+    std::vector<std::string> subprotocols;
+    std::string subprotocol;
+
+    // TCP tuning applied to every socket connect() opens
+    simplews::SocketOptions socket_options;
+    // Connected over a unix domain socket rather than TCP
+    bool local_socket = false;
+    simplews::PeerCheck peer_check;
+
+    // Give up on connecting (TCP and the upgrade together) after this long
+    std::chrono::milliseconds connect_timeout{ 10000 };
+
+    // Happy eyeballs (RFC 8305): start the next address this long after the last if it hasn't connected yet
+    static constexpr int attempt_delay_ms = 250;
+
+    // True if the last socket call failed only because it would have blocked
+    static bool would_block() {
+#ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+    }
+
+    static bool set_blocking_mode(SOCKET fd, bool nonBlocking) {
+#ifdef _WIN32
+        u_long mode = nonBlocking ? 1 : 0;
+        return ioctlsocket(fd, FIONBIO, &mode) == 0;
+#else
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags < 0) return false;
+        flags = nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+        return fcntl(fd, F_SETFL, flags) == 0;
+#endif
+    }
+
+    static int milliseconds_until(std::chrono::steady_clock::time_point deadline) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        return left < 0 ? 0 : (int)(std::min)((long long)left, (long long)INT_MAX);
+    }
+
+    // Connect to the first address that answers.  Every address getaddrinfo gives us is tried,
+    // alternating IPv6 and IPv4, with a new attempt started every attempt_delay_ms while the
+    // earlier ones are still in flight, so one dead route doesn't stall the whole connect.
+    static SOCKET open_socket(const std::string& host, const std::string& port, const simplews::SocketOptions& options, std::chrono::steady_clock::time_point deadline) {
+        struct addrinfo* result = NULL, hints;
+        ZeroMemory(&hints, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) {
+            return INVALID_SOCKET;
+        }
+
+        std::vector<struct addrinfo*> v6, v4, order;
+        for (struct addrinfo* ptr = result; ptr != NULL; ptr = ptr->ai_next) {
+            (ptr->ai_family == AF_INET6 ? v6 : v4).push_back(ptr);
+        }
+        for (size_t i = 0; i < (std::max)(v6.size(), v4.size()); i++) {
+            if (i < v6.size()) order.push_back(v6[i]);
+            if (i < v4.size()) order.push_back(v4[i]);
+        }
+
+        SOCKET winner = INVALID_SOCKET;
+        std::vector<SIMPLEWS_POLLFD> pending;
+        size_t next = 0;
+        auto nextStart = std::chrono::steady_clock::now();
+        while (winner == INVALID_SOCKET) {
+            auto now = std::chrono::steady_clock::now();
+            if (next < order.size() && (now >= nextStart || pending.empty())) {
+                struct addrinfo* address = order[next++];
+                SOCKET fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+                if (fd == INVALID_SOCKET) continue;
+                simplews::apply_socket_options(fd, options);
+                if (!set_blocking_mode(fd, true)) {
+                    closesocket(fd);
+                    continue;
+                }
+                if (::connect(fd, address->ai_addr, (int)address->ai_addrlen) == 0) {
+                    winner = fd;
+                    break;
+                }
+#ifdef _WIN32
+                bool inProgress = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+                bool inProgress = errno == EINPROGRESS;
+#endif
+                if (!inProgress) {
+                    closesocket(fd);
+                    continue;  // Refused straight away, go on to the next address now
+                }
+                SIMPLEWS_POLLFD entry = {};
+                entry.fd = fd;
+                entry.events = POLLOUT;
+                pending.push_back(entry);
+                nextStart = now + std::chrono::milliseconds(attempt_delay_ms);
+                continue;
+            }
+            if (pending.empty() || now >= deadline) break;
+
+            int waitMs = milliseconds_until(deadline);
+            if (next < order.size()) waitMs = (std::min)(waitMs, milliseconds_until(nextStart));
+            int ready = SIMPLEWS_POLL(pending.data(), (unsigned long)pending.size(), waitMs);
+            if (ready < 0) {
+#ifndef _WIN32
+                if (errno == EINTR) continue;
+#endif
+                break;
+            }
+            for (size_t i = 0; i < pending.size() && winner == INVALID_SOCKET;) {
+                if (pending[i].revents == 0) {
+                    i++;
+                    continue;
+                }
+                int error = 0;
+                socklen_t length = sizeof(error);
+                if (getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, (char*)&error, &length) == 0 && error == 0) {
+                    winner = pending[i].fd;
+                    pending.erase(pending.begin() + i);
+                } else {
+                    // That one failed, don't wait out the delay before trying the next
+                    closesocket(pending[i].fd);
+                    pending.erase(pending.begin() + i);
+                    nextStart = std::chrono::steady_clock::now();
+                }
+            }
+        }
+
+        for (const SIMPLEWS_POLLFD& entry : pending) {
+            closesocket(entry.fd);
+        }
+        freeaddrinfo(result);
+        if (winner != INVALID_SOCKET && !set_blocking_mode(winner, false)) {
+            closesocket(winner);
+            winner = INVALID_SOCKET;
+        }
+        return winner;
+    }
+
+    // Wait for the socket to become readable, false on timeout
+    bool wait_readable(std::chrono::steady_clock::time_point deadline) {
+        SIMPLEWS_POLLFD pfd = {};
+        pfd.fd = socket_fd;
+        pfd.events = POLLIN;
+        for (;;) {
+            int res = SIMPLEWS_POLL(&pfd, 1, milliseconds_until(deadline));
+#ifndef _WIN32
+            if (res < 0 && errno == EINTR) continue;
+#endif
+            return res > 0;
+        }
+    }
+
+    // Used by send_all when the socket is non-blocking and the kernel buffer is full
+    bool wait_writable() {
+#ifdef _WIN32
+        WSAPOLLFD pfd = { socket_fd, POLLWRNORM, 0 };
+        return WSAPoll(&pfd, 1, -1) > 0;
+#else
+        struct pollfd pfd = { socket_fd, POLLOUT, 0 };
+        int res;
+        do {
+            res = ::poll(&pfd, 1, -1);
+        } while (res < 0 && errno == EINTR);
+        return res > 0 && !(pfd.revents & (POLLERR | POLLNVAL));
+#endif
+    }
 
     bool send_all(const uint8_t* buffer, size_t length) {
         size_t total = 0;
@@ -44,14 +337,348 @@ private:
         int sent;
 
         while (total < length) {
-            sent = ::send(socket_fd, (char*)buffer + total, (int)bytes_left, 0);
-            if (sent == SOCKET_ERROR) return false;
+            sent = ::send(socket_fd, (char*)buffer + total, (int)bytes_left, MSG_NOSIGNAL);
+            if (sent == SOCKET_ERROR) {
+                if (non_blocking && would_block() && wait_writable()) continue;
+                return false;
+            }
             total += sent;
             bytes_left -= sent;
         }
         return true;
     }
 
+    // Write as much of tx_pending as the socket takes right now, send_mutex must be held.
+    // False only if the connection has failed.
+    bool write_pending() {
+        while (tx_pending_sent < tx_pending.size()) {
+            size_t left = (std::min)(tx_pending.size() - tx_pending_sent, (size_t)INT_MAX);
+#ifdef _WIN32
+            int sent = ::send(socket_fd, (char*)tx_pending.data() + tx_pending_sent, (int)left, 0);
+#else
+            ssize_t sent = ::send(socket_fd, tx_pending.data() + tx_pending_sent, left, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0 && errno == EINTR) continue;
+#endif
+            if (sent == SOCKET_ERROR) return would_block();
+            tx_pending_sent += (size_t)sent;
+        }
+        tx_pending.clear();
+        tx_pending_sent = 0;
+        return true;
+    }
+
+    // A piece of an outgoing gather write
+    struct Slice {
+        const uint8_t* data;
+        size_t length;
+    };
+
+    // Write all the slices with as few writev/WSASend calls as the kernel allows
+    bool send_slices(Slice* slices, size_t count) {
+        static constexpr size_t maxSlices = 16;
+        // Whatever was queued earlier goes first, and a send that may wait waits for it too
+        while (tx_pending_sent < tx_pending.size()) {
+            if (!write_pending()) return false;
+            if (!tx_pending.empty() && !wait_writable()) return false;
+        }
+        while (count > 0) {
+            size_t batch = (std::min)(count, maxSlices);
+#ifdef _WIN32
+            WSABUF buffers[maxSlices];
+            for (size_t i = 0; i < batch; i++) {
+                buffers[i].buf = (char*)slices[i].data;
+                buffers[i].len = (ULONG)slices[i].length;
+            }
+            DWORD sentBytes = 0;
+            if (WSASend(socket_fd, buffers, (DWORD)batch, &sentBytes, 0, NULL, NULL) == SOCKET_ERROR) {
+                if (non_blocking && would_block() && wait_writable()) continue;
+                return false;
+            }
+            size_t sent = sentBytes;
+#else
+            struct iovec buffers[maxSlices];
+            for (size_t i = 0; i < batch; i++) {
+                buffers[i].iov_base = (void*)slices[i].data;
+                buffers[i].iov_len = slices[i].length;
+            }
+            ssize_t result;
+#ifdef SIMPLEWS_WITH_URING
+            if (uring.active()) {
+                result = uring.send(buffers, batch);
+            } else
+#endif
+            {
+                struct msghdr msg = {};
+                msg.msg_iov = buffers;
+                msg.msg_iovlen = batch;
+                result = ::sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+            }
+            if (result < 0) {
+                if (errno == EINTR) continue;
+                if (non_blocking && would_block() && wait_writable()) continue;
+                return false;
+            }
+            size_t sent = (size_t)result;
+#endif
+            // Skip over whatever made it out, a partial write leaves us part way into a slice
+            while (count > 0 && sent >= slices->length) {
+                sent -= slices->length;
+                slices++;
+                count--;
+            }
+            if (count > 0) {
+                slices->data += sent;
+                slices->length -= sent;
+            }
+        }
+        return true;
+    }
+
+    // What became of a frame once it had been through the message assembler
+    enum class FrameAction {
+        MESSAGE,   // A message is complete, see message_data/message_length
+        NONE,      // Nothing to deliver yet
+        CLOSED,    // The server closed the connection
+        FAILED     // Protocol violation or the message is too big
+    };
+
+    FrameAction assemble(const simplews::Frame& frame) {
+        Opcode opcode = (Opcode)frame.opcode;
+        bool compressed = (frame.rsv & 0b100) != 0;
+        if (frame.opcode & 0x8) {
+            // Control frames may turn up between the fragments of a message but are never part of one
+            if (!frame.fin || frame.length > 125 || frame.rsv != 0) return FrameAction::FAILED;
+            return handle_control(opcode, frame.payload, frame.length);
+        }
+
+        if (opcode == Opcode::CONTINUATION) {
+            if (!in_fragment || frame.rsv != 0) return FrameAction::FAILED;
+            if (frame.length > max_message_size - fragments.size()) return FrameAction::FAILED;
+            fragments.append((const char*)frame.payload, frame.length);
+            if (!frame.fin) return FrameAction::NONE;
+
+            in_fragment = false;
+            message_opcode = fragment_opcode;
+            if (fragment_compressed) {
+                return inflate_message((const uint8_t*)fragments.data(), fragments.length());
+            }
+            message_data = fragments.data();
+            message_length = fragments.length();
+            return FrameAction::MESSAGE;
+        }
+
+        if (opcode != Opcode::TEXT && opcode != Opcode::BINARY) return FrameAction::FAILED;
+        if (in_fragment) return FrameAction::FAILED;  // A new message before the last one finished
+        if (frame.length > max_message_size) return FrameAction::FAILED;
+        // RSV1 marks a compressed message, and only if we negotiated it; the other bits are never used
+        if ((frame.rsv & 0b011) != 0 || (compressed && !deflate.active())) return FrameAction::FAILED;
+
+        if (frame.fin) {
+            message_opcode = opcode;
+            if (compressed) {
+                return inflate_message(frame.payload, frame.length);
+            }
+            // The common case, hand the payload out straight from the receive buffer
+            message_data = (const char*)frame.payload;
+            message_length = frame.length;
+            return FrameAction::MESSAGE;
+        }
+
+        // First fragment, reserve generously up front so appending the rest doesn't keep reallocating
+        fragments.clear();
+        fragments.reserve((std::min)(max_message_size, (std::max)(fragments.capacity(), frame.length * 4)));
+        fragments.append((const char*)frame.payload, frame.length);
+        fragment_opcode = opcode;
+        fragment_compressed = compressed;
+        in_fragment = true;
+        return FrameAction::NONE;
+    }
+
+    FrameAction inflate_message(const uint8_t* data, size_t length) {
+        if (!deflate.decompress(data, length, inflate_out, max_message_size)) {
+            return FrameAction::FAILED;
+        }
+        message_data = inflate_out.data();
+        message_length = inflate_out.length();
+        return FrameAction::MESSAGE;
+    }
+
+    // Control frames are dealt with here and never reach the message handlers
+    FrameAction handle_control(Opcode opcode, const uint8_t* payload, size_t length) {
+        switch (opcode) {
+        case Opcode::PING: {
+            // Answer with the same payload
+            std::lock_guard<std::mutex> lock(send_mutex);
+            send_control(Opcode::PONG, payload, length);
+            return FrameAction::NONE;
+        }
+        case Opcode::PONG:
+            // Ours carry the 8 byte send time; anything else is an unsolicited pong
+            if (length == 8) {
+                int64_t sent = 0;
+                for (int i = 0; i < 8; i++) {
+                    sent = (int64_t)(((uint64_t)sent << 8) | payload[i]);
+                }
+                int64_t sample = now_ns() - sent;
+                if (sample >= 0) record_rtt(sample);
+            }
+            return FrameAction::NONE;
+        case Opcode::CLOSE: {
+            // Echo the status code back to finish the closing handshake
+            std::lock_guard<std::mutex> lock(send_mutex);
+            send_control(Opcode::CLOSE, payload, length >= 2 ? 2 : 0);
+            return FrameAction::CLOSED;
+        }
+        default:
+            return FrameAction::FAILED;  // Reserved control opcode
+        }
+    }
+
+    // Send a single frame, send_mutex must be held
+    bool send_frame(Opcode opcode, bool fin, const uint8_t* data, size_t length, uint8_t rsv = 0) {
+        uint8_t mask[4];
+        uint32_t maskKey = (uint32_t)mask_generator();
+        memcpy(mask, &maskKey, sizeof(mask));
+
+        uint8_t header[simplews::max_header_length];
+        size_t headerLength = simplews::encode_header(header, (uint8_t)opcode, fin, rsv, length, mask);
+
+        // Grow the scratch buffer if we have to; it never shrinks
+        if (tx_buffer.size() < length) {
+            tx_buffer.resize(length);
+        }
+        simplews::apply_mask(tx_buffer.data(), data, length, mask);
+
+        Slice slices[2] = {
+            { header, headerLength },
+            { tx_buffer.data(), length }
+        };
+        return send_slices(slices, length == 0 ? 1 : 2);
+    }
+
+    // A control frame, send_mutex must be held.  In non-blocking mode (an event loop) it is queued
+    // behind anything pending rather than waited on, so answering a ping never holds up the loop.
+    bool send_control(Opcode opcode, const uint8_t* payload, size_t length) {
+        if (!non_blocking) return send_frame(opcode, true, payload, length);
+        append_frame(tx_pending, opcode, true, payload, length);
+        return write_pending();
+    }
+
+    // Append a whole masked frame (header and payload) to out, send_mutex must be held
+    void append_frame(std::vector<uint8_t>& out, Opcode opcode, bool fin, const uint8_t* data, size_t length, uint8_t rsv = 0) {
+        uint8_t mask[4];
+        uint32_t maskKey = (uint32_t)mask_generator();
+        memcpy(mask, &maskKey, sizeof(mask));
+
+        size_t start = out.size();
+        out.resize(start + simplews::max_header_length + length);
+        size_t headerLength = simplews::encode_header(out.data() + start, (uint8_t)opcode, fin, rsv, length, mask);
+        simplews::apply_mask(out.data() + start + headerLength, data, length, mask);
+        out.resize(start + headerLength + length);
+    }
+
+    // Compress (if it's worth it) and split (if it's too long) a message, calling
+    // emit(opcode, fin, data, length, rsv) for each frame.  send_mutex must be held.
+    template <typename Emit>
+    bool for_each_frame(const std::string& message, Opcode opcode, Emit emit) {
+        const uint8_t* data = (const uint8_t*)message.data();
+        size_t length = message.length();
+        uint8_t rsv = 0;
+        if (deflate.wants(length) && deflate.compress(data, length, deflate_out)) {
+            data = (const uint8_t*)deflate_out.data();
+            length = deflate_out.length();
+            rsv = 0b100;  // RSV1, only set on the first frame of a message
+        }
+
+        if (fragment_size == 0 || length <= fragment_size) {
+            return emit(opcode, true, data, length, rsv);
+        }
+
+        // Too big for one frame, the scratch buffer only needs to hold one fragment at a time
+        Opcode frameOpcode = opcode;
+        for (size_t offset = 0; offset < length; offset += fragment_size) {
+            size_t chunk = (std::min)(fragment_size, length - offset);
+            if (!emit(frameOpcode, offset + chunk == length, data + offset, chunk, rsv)) {
+                return false;
+            }
+            frameOpcode = Opcode::CONTINUATION;
+            rsv = 0;
+        }
+        return true;
+    }
+
+    // Read once from the socket into the decoder's buffer, returns the byte count
+    // (0 for a closed connection, SOCKET_ERROR on failure or if a non-blocking read would block).
+    // drained is set if the read came up short, i.e. the socket has nothing more for now.
+    int fill(bool* drained = nullptr) {
+        static constexpr size_t minimumRead = 4096;
+        simplews::ReceiveBuffer& buffer = decoder.buffer();
+#ifdef SIMPLEWS_WITH_URING
+        if (uring.active()) {
+            // The ring has already read the data, it only needs copying over
+            int copied = uring.receive(buffer, !non_blocking, drained);
+            if (copied > 0) last_activity = now_ns();
+            return copied;
+        }
+#endif
+        char* target = (char*)buffer.prepare((std::max)(decoder.bytes_needed(), minimumRead));
+        size_t space = (std::min)(buffer.writable(), (size_t)INT_MAX);
+        int received;
+        do {
+            received = ::recv(socket_fd, target, (int)space, 0);
+#ifdef _WIN32
+        } while (false);
+#else
+        } while (received < 0 && errno == EINTR);
+#endif
+        if (received > 0) {
+            buffer.commit(received);
+            last_activity = now_ns();
+            if (socket_options.quickAck && !local_socket) simplews::rearm_quick_ack(socket_fd);
+        }
+        if (drained) *drained = received > 0 && (size_t)received < space;
+        return received;
+    }
+
+    // Read the server's upgrade response, checking it answers our key.  Any frames that came in
+    // behind it are left in the decoder's buffer.
+    bool read_handshake(const std::string& key, std::chrono::steady_clock::time_point deadline) {
+        simplews::HandshakeResponse response;
+        char buffer[1024];
+        for (;;) {
+            if (!wait_readable(deadline)) return false;
+            int received = recv(socket_fd, buffer, sizeof(buffer), 0);
+#ifndef _WIN32
+            if (received < 0 && errno == EINTR) continue;
+#endif
+            if (received <= 0) return false;
+
+            size_t used = 0;
+            simplews::HandshakeResponse::Result result = response.feed(buffer, (size_t)received, &used);
+            if (result == simplews::HandshakeResponse::Result::NEED_MORE) continue;
+            if (result == simplews::HandshakeResponse::Result::BAD_RESPONSE) return false;
+
+            if (!response.is_upgrade(base64_encode(simplews::sha1(key + simplews::websocket_guid)))) {
+                return false;
+            }
+            if (!deflate.accept(response.header("Sec-WebSocket-Extensions"))) {
+                return false;
+            }
+            // The server may pick one of the subprotocols we offered, or none, but nothing else
+            subprotocol = response.header("Sec-WebSocket-Protocol");
+            if (!subprotocol.empty() && std::find(subprotocols.begin(), subprotocols.end(), subprotocol) == subprotocols.end()) {
+                return false;
+            }
+            size_t extra = (size_t)received - used;
+            if (extra > 0) {
+                simplews::ReceiveBuffer& frames = decoder.buffer();
+                memcpy(frames.prepare(extra), buffer + used, extra);
+                frames.commit(extra);
+            }
+            return true;
+        }
+    }
+
     std::string generateRandomString(size_t length) {
     const std::string characters = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
                                   "abcdefghijklmnopqrstuvwxyz"
@@ -85,39 +712,29 @@ public:
     }
 
     bool connect(const std::string& url) {
-        struct addrinfo* result = NULL, hints;
-        ZeroMemory(&hints, sizeof(hints));
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
-        hints.ai_protocol = IPPROTO_TCP;
+        auto deadline = std::chrono::steady_clock::now() + connect_timeout;
+        // Senders on other threads wait until the upgrade is through, nothing of theirs can go
+        // out ahead of the GET or reach a half set up socket
+        std::lock_guard<std::mutex> lock(send_mutex);
 
-        // Assume URL is in format "host:port"
-        size_t pos = url.find(":");
-        std::string host = url.substr(0, pos);
-        std::string port = url.substr(pos + 1);
-
-        int iResult = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
-        if (iResult != 0) {
+        // Either "unix:///path/to/socket" or "host:port"
+        static const std::string unixScheme = "unix://";
+        std::string host;
+        local_socket = url.compare(0, unixScheme.size(), unixScheme) == 0;
+        if (local_socket) {
+            host = "localhost";
+#ifdef _WIN32
+            std::cerr << "unix:// URLs are not supported on Windows." << std::endl;
             return false;
+#else
+            socket_fd = simplews::open_unix_socket(url.substr(unixScheme.size()), socket_options, peer_check, deadline);
+#endif
+        } else {
+            size_t pos = url.find(":");
+            host = url.substr(0, pos);
+            std::string port = url.substr(pos + 1);
+            socket_fd = open_socket(host, port, socket_options, deadline);
         }
-
-        for (struct addrinfo* ptr = result; ptr != NULL; ptr = ptr->ai_next) {
-            socket_fd = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
-            if (socket_fd == INVALID_SOCKET) {
-                continue;
-            }
-
-            iResult = ::connect(socket_fd, ptr->ai_addr, (int)ptr->ai_addrlen);
-            if (iResult == SOCKET_ERROR) {
-                closesocket(socket_fd);
-                socket_fd = INVALID_SOCKET;
-                continue;
-            }
-            break;
-        }
-
-        freeaddrinfo(result);
-
         if (socket_fd == INVALID_SOCKET) {
             return false;
         }
@@ -129,148 +746,376 @@ public:
             "Upgrade: websocket\r\n"
             "Connection: Upgrade\r\n"
             "Sec-WebSocket-Key: "+key+"\r\n"
-            "Sec-WebSocket-Version: 13\r\n\r\n";
+            "Sec-WebSocket-Version: 13\r\n";
+        std::string extensions = deflate.offer();
+        if (!extensions.empty()) {
+            handshake += "Sec-WebSocket-Extensions: " + extensions + "\r\n";
+        }
+        if (!subprotocols.empty()) {
+            handshake += "Sec-WebSocket-Protocol: ";
+            for (size_t i = 0; i < subprotocols.size(); i++) {
+                if (i > 0) handshake += ", ";
+                handshake += subprotocols[i];
+            }
+            handshake += "\r\n";
+        }
+        handshake += "\r\n";
         if (!send_all((uint8_t*)handshake.c_str(), handshake.length())) {
             closesocket(socket_fd);
             socket_fd = INVALID_SOCKET;
             return false;
         }
 
-        // Check for successful upgrade response
-        // This is pseudo-code; real implementation would involve more detailed parsing
-        char buffer[1024];
-        if (recv(socket_fd, buffer, sizeof(buffer) - 1, 0) == SOCKET_ERROR) {
+        decoder.reset();
+        subprotocol.clear();
+        if (!read_handshake(key, deadline)) {
             closesocket(socket_fd);
             socket_fd = INVALID_SOCKET;
             return false;
         }
-        buffer[sizeof(buffer) - 1] = '\0';
-        if (strstr(buffer, "101 Switching Protocols") == NULL) {
-            closesocket(socket_fd);
-            socket_fd = INVALID_SOCKET;
-            return false;
+
+#ifdef SIMPLEWS_WITH_URING
+        if (use_uring && !uring.start(socket_fd)) {
+            std::cerr << "io_uring setup failed, using the socket directly." << std::endl;
         }
+#endif
+
+        last_activity = now_ns();
+        last_rtt = -1;
+        smoothed_rtt = -1;
+        rtt_variation = 0;
+        rtt_samples = 0;
 
         return true;
     }
 
+    // Called by on_readable() with a copy of each message
     void set_on_message(MessageCallback callback) {
         on_message = callback;
     }
 
-    bool send(const std::string& message, Opcode opcode = Opcode::TEXT) {
-        uint8_t* sendBuffer = new uint8_t[20 + message.length()];
-        //set message to not fragmented, type as text, and no special flags
-        sendBuffer[0] = 0b10000001;
-        uint8_t offset = 0;
-        size_t lengthOfMessage = message.length();
-        //set the mask to true on each of these(first bit set to 1)
-        if( lengthOfMessage <= 125)
-        {
-            sendBuffer[1] = 0b10000000 + (uint8_t)message.length();
-        }
-        else if(( lengthOfMessage >= 125) && (lengthOfMessage <= SHRT_MAX))
-        {
-            // Set mask to true and length to 126
-            sendBuffer[1] = 0b11111110;
-            sendBuffer[2] = (uint8_t)(lengthOfMessage >> 8);
-            sendBuffer[3] = (uint8_t)(lengthOfMessage);
-            offset = 2;
-        }
-        else {
-            // Set the length to 127 and the mask to true
-            sendBuffer[1] = 0xff;
-            // Depending on the world size_t is either 32 or 64 bits
-            // So at compile time determine the size of size_t
-            // and then set the appropriate bytes
-#if SIZE_MAX == UINT32_MAX
-            sendBuffer[2] = 0;
-            sendBuffer[3] = 0;
-            sendBuffer[4] = 0;
-            sendBuffer[5] = 0;
+    // Called by on_readable() with each message in place, no copy made.  Takes over from set_on_message().
+    void set_on_message_view(MessageViewCallback callback) {
+        on_message_view = callback;
+    }
+
+    SOCKET native_handle() const { return socket_fd; }
+
+    // Ask for the io_uring transport on the next connect().  Returns false if it isn't compiled in.
+    bool set_io_uring(bool enable) {
+#ifdef SIMPLEWS_WITH_URING
+        use_uring = enable;
+        return true;
+#else
+        use_uring = false;
+        return !enable;
+#endif
+    }
+
+    bool uring_active() const {
+#ifdef SIMPLEWS_WITH_URING
+        return uring.active();
+#else
+        return false;
+#endif
+    }
+
+    // What an event loop should watch for readability: the ring when io_uring is in use, the socket otherwise
+    SOCKET event_handle() const {
+#ifdef SIMPLEWS_WITH_URING
+        if (uring.active()) return uring.event_fd();
+#endif
+        return socket_fd;
+    }
+
+    // Switch the socket between blocking and non-blocking mode, used when an event loop drives us.
+    // Non-blocking, pings and the replies to the server's control frames are queued when the socket
+    // is full: watch for writability while pending_bytes() is not zero and call flush_pending().
+    bool set_nonblocking(bool enable) {
+        std::lock_guard<std::mutex> lock(send_mutex);  // A sender may be looking at non_blocking
+        if (socket_fd == INVALID_SOCKET) return false;
+        if (!set_blocking_mode(socket_fd, enable)) return false;
+        non_blocking = enable;
+        return true;
+    }
+
+    // How long connect() may take, covering the TCP connect and the upgrade
+    void set_connect_timeout(std::chrono::milliseconds timeout) { connect_timeout = timeout; }
+
+    // Subprotocols to offer on the next connect(), most preferred first
+    void set_subprotocols(const std::vector<std::string>& offered) { subprotocols = offered; }
+
+    // The subprotocol the server chose, empty if none
+    const std::string& selected_subprotocol() const { return subprotocol; }
+
+    // Who may be listening on a unix:// socket, see simplews::PeerCheck
+    void set_peer_check(simplews::PeerCheck check) { peer_check = check; }
+
+    // TCP options for the next connect()
+    void set_socket_options(const simplews::SocketOptions& options) { socket_options = options; }
+
+    // Largest message (after reassembly) we accept, anything bigger fails the connection
+    void set_max_message_size(size_t size) {
+        max_message_size = size;
+        decoder.set_max_frame_length(size);
+    }
+
+    // Send a ping stamped with the current time, the pong gives us an RTT sample
+    bool send_ping() {
+        uint8_t payload[8];
+        int64_t now = now_ns();
+        for (int i = 0; i < 8; i++) {
+            payload[i] = (uint8_t)((uint64_t)now >> (56 - 8 * i));
+        }
+        std::lock_guard<std::mutex> lock(send_mutex);
+        return send_control(Opcode::PING, payload, sizeof(payload));
+    }
+
+    // How long since anything at all arrived from the server
+    std::chrono::nanoseconds idle_time() const {
+        return std::chrono::nanoseconds(now_ns() - last_activity);
+    }
+
+    // Round trip times from ping/pong, negative until the first pong arrives
+    std::chrono::nanoseconds last_round_trip() const { return std::chrono::nanoseconds(last_rtt.load()); }
+    std::chrono::nanoseconds smoothed_round_trip() const { return std::chrono::nanoseconds(smoothed_rtt.load()); }
+    std::chrono::nanoseconds round_trip_jitter() const { return std::chrono::nanoseconds(rtt_variation.load()); }
+    uint64_t round_trip_samples() const { return rtt_samples; }
+
+    // Wake up anything blocked on the socket without closing it (close() still has to be called)
+    void interrupt() {
+        SOCKET fd = socket_fd.load();
+        if (fd != INVALID_SOCKET) {
+#ifdef _WIN32
+            shutdown(fd, SD_BOTH);
 #else
-            // Set the first byte to 0 since we are only using 32 bits
-            sendBuffer[2] = (uint8_t)((lengthOfMessage >> 56) & 0xff);
-            sendBuffer[3] = (uint8_t)((lengthOfMessage >> 48) & 0xff);
-            sendBuffer[4] = (uint8_t)((lengthOfMessage >> 40) & 0xff);
-            sendBuffer[5] = (uint8_t)((lengthOfMessage >> 32) & 0xff);
+            shutdown(fd, SHUT_RDWR);
 #endif
-            sendBuffer[6] = (uint8_t)((lengthOfMessage >> 24) & 0xff);
-            sendBuffer[7] = (uint8_t)((lengthOfMessage >> 16) & 0xff);
-            sendBuffer[8] = (uint8_t)((lengthOfMessage >> 8));
-            sendBuffer[9] = (uint8_t)(lengthOfMessage & 0xff);
-            offset = 8;
-        }
-        
-        //generate the masking key
-        std::random_device randomDevice;
-        std::mt19937 mersenneTwister;
-        std::uniform_int_distribution<uint16_t> distribution(0, 255);
-        sendBuffer[2 + offset] = (char)distribution(mersenneTwister);
-        sendBuffer[3 + offset] = (char)distribution(mersenneTwister);
-        sendBuffer[4 + offset] = (char)distribution(mersenneTwister);
-        sendBuffer[5 + offset] = (char)distribution(mersenneTwister);
-
-        //add the data to the toSend array
-        for (int i = 0; i < message.length(); i++)
-        {
-            //xor the byte with the masking key to "mask" the message
-            sendBuffer[6 + offset + i] = message[i] ^ sendBuffer[2 + offset + i % 4];
-        }
-        
-        bool res = send_all(sendBuffer, (size_t)offset + 6 + message.length());
-        delete[] sendBuffer;
-        return res;
-    }
-
-    void receive(std::string *stringBuffer) {
-        if (socket_fd == INVALID_SOCKET) return;
-
-        char socketBuffer[2];
-        int bytesRecieved1 = ::recv(socket_fd, socketBuffer, sizeof(socketBuffer),0);
-        uint8_t payloadLengthSimple = socketBuffer[1] & 0b01111111; //get the seven least significant bits
-        uint64_t payloadLength=0;
-        if (payloadLengthSimple <= 125)
-        {
-            payloadLength = payloadLengthSimple;
-        }
-        else if (payloadLengthSimple == 126)
-        {
-            uint8_t payloadLengthBuffer[2];
-            ::recv(socket_fd, (char*)payloadLengthBuffer, sizeof(payloadLengthBuffer), 0);
-            payloadLength = (uint64_t)payloadLengthBuffer[0] << 8;
-            payloadLength += (uint64_t)payloadLengthBuffer[1];
-        }
-        else if (payloadLengthSimple == 127)
-        {
-            uint8_t payloadLengthBuffer[8];
-            ::recv(socket_fd, (char*)payloadLengthBuffer, sizeof(payloadLengthBuffer), 0);
-            payloadLength = (uint64_t)payloadLengthBuffer[0] << 56;
-            payloadLength += (uint64_t)payloadLengthBuffer[1] << 48;
-            payloadLength += (uint64_t)payloadLengthBuffer[2] << 40;
-            payloadLength += (uint64_t)payloadLengthBuffer[3] << 32;
-            payloadLength += (uint64_t)payloadLengthBuffer[4] << 24;
-            payloadLength += (uint64_t)payloadLengthBuffer[5] << 16;
-            payloadLength += (uint64_t)payloadLengthBuffer[6] << 8;
-            payloadLength += (uint64_t)payloadLengthBuffer[7];
-        }
-        char* textBuffer = new char[payloadLength + 1];
-        uint32_t bytesRecieved = 0;
-        while (bytesRecieved < payloadLength)
-        {
-            bytesRecieved += ::recv(socket_fd, textBuffer + bytesRecieved, payloadLength - bytesRecieved, 0);
-        }
-        textBuffer[payloadLength] = '\0';
-        *stringBuffer = std::string(textBuffer, bytesRecieved);
-        delete[] textBuffer;
+        }
+    }
+
+    // Offer permessage-deflate on the next connect()
+    void set_deflate_options(const simplews::DeflateOptions& options) {
+        deflate.set_options(options);
+    }
+
+    // True if the server accepted permessage-deflate
+    bool deflate_active() const { return deflate.active(); }
+
+    // Bytes in and out of the compressor and decompressor so far
+    simplews::DeflateStats deflate_stats() const { return deflate.stats(); }
+
+    // Split outgoing messages longer than this into fragments, 0 never splits
+    void set_fragment_size(size_t size) {
+        fragment_size = size;
+    }
+
+    bool send(const std::string& message, Opcode opcode = Opcode::TEXT) {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        return for_each_frame(message, opcode, [this](Opcode frameOpcode, bool fin, const uint8_t* data, size_t length, uint8_t rsv) {
+            return send_frame(frameOpcode, fin, data, length, rsv);
+        });
+    }
+
+    // Send several messages with as few writes as possible: every frame is encoded into one buffer
+    // which goes out in a single call.  Returns false if the connection failed part way.
+    bool send_batch(const std::vector<std::string>& messages, Opcode opcode = Opcode::TEXT) {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        tx_batch.clear();
+        for (const std::string& message : messages) {
+            for_each_frame(message, opcode, [this](Opcode frameOpcode, bool fin, const uint8_t* data, size_t length, uint8_t rsv) {
+                append_frame(tx_batch, frameOpcode, fin, data, length, rsv);
+                return true;
+            });
+        }
+        Slice slice = { tx_batch.data(), tx_batch.size() };
+        return send_slices(&slice, 1);
+    }
+
+    // send_batch() for an event loop: whatever the socket doesn't take straight away is kept, in
+    // order, for flush_pending() rather than waited for.  Returns false if the connection failed.
+    bool queue_batch(const std::vector<std::string>& messages, Opcode opcode = Opcode::TEXT) {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        if (socket_fd == INVALID_SOCKET) return false;
+        for (const std::string& message : messages) {
+            for_each_frame(message, opcode, [this](Opcode frameOpcode, bool fin, const uint8_t* data, size_t length, uint8_t rsv) {
+                append_frame(tx_pending, frameOpcode, fin, data, length, rsv);
+                return true;
+            });
+        }
+        return write_pending();
+    }
+
+    // Write more of what is queued once the socket is writable, false if the connection failed.
+    // With wait, keep going until all of it has gone.
+    bool flush_pending(bool wait = false) {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        if (socket_fd == INVALID_SOCKET || !write_pending()) return false;
+        while (wait && !tx_pending.empty()) {
+            if (!wait_writable() || !write_pending()) return false;
+        }
+        return true;
+    }
+
+    // Bytes queued that the socket hasn't taken yet
+    size_t pending_bytes() {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        return tx_pending.size() - tx_pending_sent;
+    }
+
+    // Streams a single message out as a series of fragments, so a large message never has to be
+    // held in one buffer.  Other sends wait until the message is finished.  Streamed messages are
+    // never compressed.
+    //
+    //     auto writer = ws.begin_message();
+    //     writer.write(part1);
+    //     writer.write(part2);
+    //     writer.finish();
+    class MessageWriter {
+    public:
+        ~MessageWriter() {
+            if (!finished) finish();
+        }
+
+        // Send a piece of the message as a non-final fragment
+        bool write(const char* data, size_t length) {
+            if (finished || !ok) return false;
+            if (length == 0) return true;
+            ok = ws->send_frame(next_opcode, false, (const uint8_t*)data, length);
+            next_opcode = Opcode::CONTINUATION;
+            return ok;
+        }
+
+        bool write(const std::string& data) { return write(data.data(), data.length()); }
+
+        // Send the last piece (which may be empty) and let other sends through again
+        bool finish(const char* data = nullptr, size_t length = 0) {
+            if (finished) return ok;
+            if (ok) {
+                ok = ws->send_frame(next_opcode, true, (const uint8_t*)data, length);
+            }
+            finished = true;
+            lock.unlock();
+            return ok;
+        }
+
+        MessageWriter(const MessageWriter&) = delete;
+        MessageWriter& operator=(const MessageWriter&) = delete;
+
+    private:
+        friend class WebSocket;
+        MessageWriter(WebSocket* ws, Opcode opcode) : ws(ws), lock(ws->send_mutex), next_opcode(opcode) {}
+
+        WebSocket* ws;
+        std::unique_lock<std::mutex> lock;
+        Opcode next_opcode;
+        bool finished = false;
+        bool ok = true;
+    };
+
+    MessageWriter begin_message(Opcode opcode = Opcode::TEXT) {
+        return MessageWriter(this, opcode);
+    }
+
+    // Called when the socket is readable (non-blocking mode).  Reads whatever the socket
+    // has and hands every complete message to the on_message_view (or on_message) callback.
+    // Returns false once the connection has been closed or has failed.
+    bool on_readable() {
+        if (socket_fd == INVALID_SOCKET) return false;
+
+        bool drained = false;
+        for (;;) {
+            // Frames already in the buffer go first, the handshake may have left some there
+            simplews::Frame frame;
+            simplews::FrameDecoder::Result result;
+            while ((result = decoder.next(frame)) == simplews::FrameDecoder::Result::FRAME) {
+                FrameAction action = assemble(frame);
+                if (action == FrameAction::CLOSED || action == FrameAction::FAILED) return false;
+                if (action == FrameAction::MESSAGE) {
+                    if (on_message_view) {
+                        on_message_view(Message{ std::string_view(message_data, message_length), message_opcode });
+                    } else if (on_message) {
+                        message.assign(message_data, message_length);
+                        on_message(message);
+                    }
+                }
+                if (socket_fd == INVALID_SOCKET) return false;  // Closed from inside the callback
+            }
+            if (result == simplews::FrameDecoder::Result::BAD_FRAME) return false;
+
+            // A short read means the socket has been drained
+            if (drained) break;
+
+            int received = fill(&drained);
+            if (received == 0) return false;  // Orderly shutdown from the server
+            if (received < 0) {
+                if (would_block()) break;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Blocking receive of the next message, reassembled if it was fragmented.  Frames that
+    // arrived in the same read are returned from the buffer without touching the socket again.
+    // Returns false if the connection has been closed or has failed.
+    bool receive(std::string *stringBuffer, Opcode *opcode = nullptr) {
+        Message received;
+        if (!receive(&received)) return false;
+        stringBuffer->assign(received.payload.data(), received.payload.size());
+        if (opcode) *opcode = received.opcode;
+        return true;
+    }
+
+    // Blocking receive without the copy; the message is only valid until the next receive.
+    bool receive(Message *received) {
+        if (socket_fd == INVALID_SOCKET) return false;
+
+        simplews::Frame frame;
+        for (;;) {
+            simplews::FrameDecoder::Result result = decoder.next(frame);
+            if (result == simplews::FrameDecoder::Result::FRAME) {
+                FrameAction action = assemble(frame);
+                if (action == FrameAction::CLOSED || action == FrameAction::FAILED) return false;
+                if (action == FrameAction::MESSAGE) {
+                    received->payload = std::string_view(message_data, message_length);
+                    received->opcode = message_opcode;
+                    return true;
+                }
+                continue;
+            }
+            if (result == simplews::FrameDecoder::Result::BAD_FRAME) {
+                return false;
+            }
+            if (fill() <= 0) {
+                return false;
+            }
+        }
     }
 
     void close() {
+        // Shutting down first fails any send blocked on a stalled peer, so the lock comes free
+        SOCKET fd = socket_fd.load();
+        if (fd != INVALID_SOCKET) {
+            shutdown(fd, SD_SEND);
+        }
+        // Not while another thread is sending: the socket, the send ring and the compressor go
+        std::lock_guard<std::mutex> lock(send_mutex);
         if (socket_fd != INVALID_SOCKET) {
-            shutdown(socket_fd, SD_SEND);
+#ifdef SIMPLEWS_WITH_URING
+            if (uring.active()) {
+                uring.stop();
+            }
+#endif
             closesocket(socket_fd);
             socket_fd = INVALID_SOCKET;
         }
+        non_blocking = false;
+        tx_pending.clear();
+        tx_pending_sent = 0;
+        decoder.reset();
+        in_fragment = false;
+        deflate.reset();
     }
 
     // Base64 encoding
@@ -287,7 +1132,8 @@ public:
         unsigned char char_array_3[3], char_array_4[4];
 
         for (size_t len = data.size(); i < len;) {
-            char_array_3[i % 3] = data[i++];
+            char_array_3[i % 3] = data[i];
+            i++;
             if (i % 3 == 0) {
                 char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
                 char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
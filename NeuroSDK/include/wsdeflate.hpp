@@ -0,0 +1,316 @@
+#ifndef WSDEFLATE_HPP
+#define WSDEFLATE_HPP
+
+// permessage-deflate (RFC 7692) for simplews.hpp.
+//
+// Needs zlib, so it is only compiled in when SIMPLEWS_WITH_ZLIB is defined (and zlib is linked).
+// Without it the extension is simply never offered and everything goes out uncompressed.
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+
+#ifdef SIMPLEWS_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+namespace simplews {
+
+struct DeflateOptions {
+    // Offer permessage-deflate in the handshake
+    bool enabled = false;
+
+    // Messages shorter than this are sent uncompressed, it isn't worth it for tiny ones
+    size_t threshold = 256;
+
+    // zlib compression level (1 fastest .. 9 smallest)
+    int level = 6;
+
+    // Window used to compress what we send (9..15).  The server may ask for a smaller one; if it
+    // asks for 8 we don't compress at all.
+    int clientMaxWindowBits = 15;
+
+    // Start each outgoing message with an empty window.  Less memory, worse compression.
+    bool clientNoContextTakeover = false;
+
+    // Ask the server to do the same for what it sends us
+    bool serverNoContextTakeover = false;
+};
+
+// Byte counters so the bandwidth saved can be weighed against the CPU spent
+struct DeflateStats {
+    uint64_t messagesCompressed = 0;
+    uint64_t bytesBeforeCompression = 0;
+    uint64_t bytesAfterCompression = 0;
+    uint64_t messagesInflated = 0;
+    uint64_t bytesBeforeInflate = 0;
+    uint64_t bytesAfterInflate = 0;
+};
+
+class PerMessageDeflate {
+public:
+    PerMessageDeflate() {}
+    ~PerMessageDeflate() { reset(); }
+
+    static bool available() {
+#ifdef SIMPLEWS_WITH_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void set_options(const DeflateOptions& newOptions) { options = newOptions; }
+    const DeflateOptions& get_options() const { return options; }
+
+    // Did the server accept the extension?
+    bool active() const { return negotiated; }
+
+    // Should a message of this size be compressed?
+    bool wants(size_t length) const { return negotiated && compressOutgoing && length >= options.threshold; }
+
+    // The Sec-WebSocket-Extensions value to send, empty if we aren't offering
+    std::string offer() const {
+        if (!options.enabled || !available()) return "";
+        std::string value = "permessage-deflate; client_max_window_bits";
+        if (options.clientMaxWindowBits < 15) {
+            value += "=" + std::to_string(window_bits(options.clientMaxWindowBits));
+        }
+        if (options.clientNoContextTakeover) value += "; client_no_context_takeover";
+        if (options.serverNoContextTakeover) value += "; server_no_context_takeover";
+        return value;
+    }
+
+    // Process the server's Sec-WebSocket-Extensions response (which may list several extensions).
+    // Returns false if the server answered with parameters we can't honour.
+    bool accept(const std::string& header) {
+        reset();
+        if (!options.enabled || !available()) return true;
+
+        size_t start = 0;
+        while (start < header.length()) {
+            size_t end = header.find(',', start);
+            if (end == std::string::npos) end = header.length();
+            std::string extension = header.substr(start, end - start);
+            start = end + 1;
+
+            size_t semicolon = extension.find(';');
+            if (trim(extension.substr(0, semicolon)) != "permessage-deflate") continue;
+
+            int clientBits = window_bits(options.clientMaxWindowBits);
+            bool canCompress = true;
+            bool clientNoTakeover = options.clientNoContextTakeover;
+            bool serverNoTakeover = false;
+            while (semicolon != std::string::npos) {
+                size_t next = extension.find(';', semicolon + 1);
+                std::string param = trim(extension.substr(semicolon + 1, next == std::string::npos ? std::string::npos : next - semicolon - 1));
+                semicolon = next;
+
+                std::string value;
+                size_t equals = param.find('=');
+                if (equals != std::string::npos) {
+                    value = trim(param.substr(equals + 1));
+                    if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+                        value = value.substr(1, value.size() - 2);
+                    }
+                    param = trim(param.substr(0, equals));
+                }
+
+                if (param == "client_no_context_takeover") {
+                    clientNoTakeover = true;
+                } else if (param == "server_no_context_takeover") {
+                    serverNoTakeover = true;
+                } else if (param == "client_max_window_bits") {
+                    int bits = atoi(value.c_str());
+                    if (bits < 8 || bits > 15) return false;
+                    // zlib can't keep to an 8 bit window, it would quietly use 9 and the server
+                    // couldn't inflate that.  Uncompressed messages are always allowed, so we send
+                    // those and still inflate what the server compresses.
+                    if (bits == 8) canCompress = false;
+                    if (bits < clientBits) clientBits = window_bits(bits);
+                } else if (param == "server_max_window_bits") {
+                    // We inflate with the largest window, which copes with whatever the server uses
+                    int bits = atoi(value.c_str());
+                    if (bits < 8 || bits > 15) return false;
+                } else {
+                    return false;
+                }
+            }
+            if (!start_streams(clientBits, clientNoTakeover, serverNoTakeover)) return false;
+            compressOutgoing = canCompress;
+            return true;
+        }
+        return true;  // Not accepted, carry on uncompressed
+    }
+
+    // Compress a whole message into out (ready to go in frames with RSV1 set).
+    // Returns false if the original should be sent instead.
+    bool compress(const uint8_t* data, size_t length, std::string& out) {
+#ifdef SIMPLEWS_WITH_ZLIB
+        if (!negotiated || !compressOutgoing) return false;
+        out.resize(deflateBound(&deflater, (uLong)length) + 16);
+        deflater.next_in = (Bytef*)data;
+        deflater.avail_in = (uInt)length;
+        size_t produced = 0;
+        for (;;) {
+            deflater.next_out = (Bytef*)&out[produced];
+            deflater.avail_out = (uInt)(out.size() - produced);
+            int result = deflate(&deflater, Z_SYNC_FLUSH);
+            produced = out.size() - deflater.avail_out;
+            if (result != Z_OK && result != Z_BUF_ERROR) return false;
+            if (deflater.avail_in == 0 && deflater.avail_out > 0) break;
+            out.resize(out.size() * 2);
+        }
+        // Every flush ends with 00 00 ff ff, which the protocol says to leave off
+        if (produced >= 4) produced -= 4;
+        out.resize(produced);
+        if (clientNoContextTakeover) deflateReset(&deflater);
+
+        statistics.messagesCompressed++;
+        statistics.bytesBeforeCompression += length;
+        statistics.bytesAfterCompression += produced;
+        // With context takeover the server's window has to see every message we compressed,
+        // so only fall back to the original when each message starts from scratch anyway
+        return produced < length || !clientNoContextTakeover;
+#else
+        (void)data; (void)length; (void)out;
+        return false;
+#endif
+    }
+
+    // Inflate a whole compressed message into out, failing if it grows beyond maxSize
+    bool decompress(const uint8_t* data, size_t length, std::string& out, size_t maxSize) {
+#ifdef SIMPLEWS_WITH_ZLIB
+        if (!negotiated) return false;
+        static const uint8_t tail[4] = { 0x00, 0x00, 0xff, 0xff };
+        out.clear();
+        if (out.capacity() < length * 4) out.reserve(length * 4);
+
+        if (!inflate_some(data, length, out, maxSize)) return false;
+        if (!inflate_some(tail, sizeof(tail), out, maxSize)) return false;
+        if (serverNoContextTakeover) inflateReset(&inflater);
+
+        statistics.messagesInflated++;
+        statistics.bytesBeforeInflate += length;
+        statistics.bytesAfterInflate += out.length();
+        return true;
+#else
+        (void)data; (void)length; (void)out; (void)maxSize;
+        return false;
+#endif
+    }
+
+    DeflateStats stats() const {
+        DeflateStats snapshot;
+        snapshot.messagesCompressed = statistics.messagesCompressed;
+        snapshot.bytesBeforeCompression = statistics.bytesBeforeCompression;
+        snapshot.bytesAfterCompression = statistics.bytesAfterCompression;
+        snapshot.messagesInflated = statistics.messagesInflated;
+        snapshot.bytesBeforeInflate = statistics.bytesBeforeInflate;
+        snapshot.bytesAfterInflate = statistics.bytesAfterInflate;
+        return snapshot;
+    }
+
+    // Drop the zlib streams, the next connection negotiates again
+    void reset() {
+#ifdef SIMPLEWS_WITH_ZLIB
+        if (negotiated) {
+            deflateEnd(&deflater);
+            inflateEnd(&inflater);
+        }
+#endif
+        negotiated = false;
+    }
+
+    PerMessageDeflate(const PerMessageDeflate&) = delete;
+    PerMessageDeflate& operator=(const PerMessageDeflate&) = delete;
+
+private:
+    // raw deflate in zlib can't do an 8 bit window, 9 is the smallest it supports (see accept())
+    static int window_bits(int bits) {
+        if (bits < 9) return 9;
+        if (bits > 15) return 15;
+        return bits;
+    }
+
+    static std::string trim(const std::string& text) {
+        size_t first = text.find_first_not_of(" \t");
+        if (first == std::string::npos) return "";
+        size_t last = text.find_last_not_of(" \t");
+        return text.substr(first, last - first + 1);
+    }
+
+    bool start_streams(int clientBits, bool clientNoTakeover, bool serverNoTakeover) {
+#ifdef SIMPLEWS_WITH_ZLIB
+        deflater = {};
+        inflater = {};
+        // Negative window bits give raw deflate streams with no zlib header
+        if (deflateInit2(&deflater, options.level, Z_DEFLATED, -clientBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        if (inflateInit2(&inflater, -15) != Z_OK) {
+            deflateEnd(&deflater);
+            return false;
+        }
+        clientNoContextTakeover = clientNoTakeover;
+        serverNoContextTakeover = serverNoTakeover;
+        negotiated = true;
+        return true;
+#else
+        (void)clientBits; (void)clientNoTakeover; (void)serverNoTakeover;
+        return false;
+#endif
+    }
+
+#ifdef SIMPLEWS_WITH_ZLIB
+    bool inflate_some(const uint8_t* data, size_t length, std::string& out, size_t maxSize) {
+        inflater.next_in = (Bytef*)data;
+        inflater.avail_in = (uInt)length;
+        for (;;) {
+            size_t used = out.length();
+            size_t room = out.capacity() > used + 1024 ? out.capacity() - used : 16 * 1024;
+            out.resize(used + room);
+            inflater.next_out = (Bytef*)&out[used];
+            inflater.avail_out = (uInt)room;
+            int result = inflate(&inflater, Z_SYNC_FLUSH);
+            out.resize(used + room - inflater.avail_out);
+            if (result == Z_STREAM_END) {
+                // The server finished its stream with a final block, start a fresh one
+                inflateReset(&inflater);
+                if (inflater.avail_in == 0) break;
+                continue;
+            }
+            if (result != Z_OK && result != Z_BUF_ERROR) return false;
+            if (out.length() > maxSize) return false;
+            // Output space left over means zlib has used all the input it can
+            if (inflater.avail_out > 0) break;
+        }
+        return true;
+    }
+
+    z_stream deflater = {};
+    z_stream inflater = {};
+#endif
+
+    struct Counters {
+        std::atomic<uint64_t> messagesCompressed{ 0 };
+        std::atomic<uint64_t> bytesBeforeCompression{ 0 };
+        std::atomic<uint64_t> bytesAfterCompression{ 0 };
+        std::atomic<uint64_t> messagesInflated{ 0 };
+        std::atomic<uint64_t> bytesBeforeInflate{ 0 };
+        std::atomic<uint64_t> bytesAfterInflate{ 0 };
+    };
+
+    DeflateOptions options;
+    bool negotiated = false;
+    bool compressOutgoing = true;  // False when the server asked for a window zlib can't do
+    bool clientNoContextTakeover = false;
+    bool serverNoContextTakeover = false;
+    Counters statistics;
+};
+
+}
+
+#endif // WSDEFLATE_HPP
@@ -0,0 +1,205 @@
+#ifndef WSFRAME_HPP
+#define WSFRAME_HPP
+
+// Frame level helpers for simplews.hpp: the receive buffer, the frame decoder and the
+// frame encoder.
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include "wsmask.hpp"
+
+namespace simplews {
+
+// Per-connection receive buffer.
+//
+// It behaves like a ring buffer in that the read and write positions chase each other and
+// both snap back to the start whenever the buffer drains, but rather than wrapping data
+// around the end it slides the unread bytes down to the front.  That keeps every frame
+// contiguous so a payload can be handed out as a single pointer + length.
+class ReceiveBuffer {
+public:
+    explicit ReceiveBuffer(size_t capacity = 16 * 1024) : storage(capacity) {}
+
+    // Unread bytes
+    uint8_t* data() { return storage.data() + head; }
+    size_t size() const { return tail - head; }
+
+    // Mark bytes as read
+    void consume(size_t count) {
+        head += count;
+        if (head >= tail) {
+            head = tail = 0;
+        }
+    }
+
+    // Make sure there is room for at least count more bytes and return where to write them
+    uint8_t* prepare(size_t count) {
+        if (storage.size() - tail < count) {
+            if (head > 0) {
+                // Slide the unread bytes down rather than growing
+                memmove(storage.data(), storage.data() + head, tail - head);
+                tail -= head;
+                head = 0;
+            }
+            if (storage.size() - tail < count) {
+                storage.resize(tail + count);
+            }
+        }
+        return storage.data() + tail;
+    }
+
+    // Space available after the last prepare()
+    size_t writable() const { return storage.size() - tail; }
+
+    // Mark count bytes written at the position returned by prepare()
+    void commit(size_t count) { tail += count; }
+
+    void clear() { head = tail = 0; }
+
+private:
+    std::vector<uint8_t> storage;
+    size_t head = 0;
+    size_t tail = 0;
+};
+
+// A decoded frame.  The payload points into the decoder's buffer and stays valid until
+// the next call to FrameDecoder::next().  Masked frames have already been unmasked.
+struct Frame {
+    bool fin = true;
+    uint8_t rsv = 0;        // RSV1-3 bits, shifted down (RSV1 = 0x4)
+    uint8_t opcode = 0;
+    bool masked = false;
+    uint8_t mask[4] = { 0, 0, 0, 0 };
+    uint8_t* payload = nullptr;
+    size_t length = 0;
+};
+
+// Parses frames out of a ReceiveBuffer.  The socket is read by the owner (as much as it has
+// in one go) and next() is then called until it reports it needs more bytes, so a burst of
+// messages costs a single read.  Partial headers and payloads simply stay in the buffer.
+class FrameDecoder {
+public:
+    enum class Result {
+        FRAME,      // A complete frame was decoded
+        NEED_MORE,  // Read more data, at least bytes_needed() of it
+        BAD_FRAME   // The stream is corrupt (or a frame is larger than allowed)
+    };
+
+    ReceiveBuffer& buffer() { return rxBuffer; }
+
+    // Largest frame payload we are willing to buffer
+    void set_max_frame_length(uint64_t length) { maxFrameLength = length; }
+
+    // Bytes still missing from the frame currently at the front of the buffer
+    size_t bytes_needed() const { return needed; }
+
+    Result next(Frame& frame) {
+        // Release the frame handed out by the previous call
+        rxBuffer.consume(consumed);
+        consumed = 0;
+
+        const uint8_t* bytes = rxBuffer.data();
+        size_t available = rxBuffer.size();
+        if (available < 2) {
+            needed = 2 - available;
+            return Result::NEED_MORE;
+        }
+
+        uint8_t payloadLengthSimple = bytes[1] & 0b01111111;
+        bool masked = (bytes[1] & 0b10000000) != 0;
+        size_t headerLength = 2 + (masked ? 4 : 0);
+        if (payloadLengthSimple == 126) headerLength += 2;
+        else if (payloadLengthSimple == 127) headerLength += 8;
+        if (available < headerLength) {
+            needed = headerLength - available;
+            return Result::NEED_MORE;
+        }
+
+        uint64_t payloadLength = payloadLengthSimple;
+        size_t offset = 2;
+        if (payloadLengthSimple == 126) {
+            payloadLength = ((uint64_t)bytes[2] << 8) | bytes[3];
+            offset = 4;
+        }
+        else if (payloadLengthSimple == 127) {
+            payloadLength = 0;
+            for (int i = 2; i < 10; i++) {
+                payloadLength = (payloadLength << 8) | bytes[i];
+            }
+            offset = 10;
+        }
+        if (payloadLength > maxFrameLength) {
+            return Result::BAD_FRAME;
+        }
+        if (available - headerLength < payloadLength) {
+            needed = (size_t)(headerLength + payloadLength - available);
+            return Result::NEED_MORE;
+        }
+
+        frame.fin = (bytes[0] & 0b10000000) != 0;
+        frame.rsv = (bytes[0] >> 4) & 0b0111;
+        frame.opcode = bytes[0] & 0b00001111;
+        frame.masked = masked;
+        if (masked) {
+            memcpy(frame.mask, bytes + offset, 4);
+        }
+        frame.payload = rxBuffer.data() + headerLength;
+        frame.length = (size_t)payloadLength;
+        if (masked) {
+            // Servers shouldn't mask, but test stand-ins do; unmask in place
+            apply_mask(frame.payload, frame.payload, frame.length, frame.mask);
+        }
+
+        consumed = headerLength + frame.length;
+        needed = 0;
+        return Result::FRAME;
+    }
+
+    void reset() {
+        rxBuffer.clear();
+        consumed = 0;
+        needed = 0;
+    }
+
+private:
+    ReceiveBuffer rxBuffer;
+    size_t consumed = 0;
+    size_t needed = 0;
+    uint64_t maxFrameLength = 64ull * 1024 * 1024;
+};
+
+// Longest possible frame header: 2 bytes + 8 byte length + 4 byte mask
+static constexpr size_t max_header_length = 14;
+
+// Write a frame header into out (which must have room for max_header_length bytes) and
+// return its length.  Client frames are always masked, so the mask key is included.
+inline size_t encode_header(uint8_t* out, uint8_t opcode, bool fin, uint8_t rsv, uint64_t length, const uint8_t mask[4]) {
+    out[0] = (fin ? 0b10000000 : 0) | ((rsv & 0b0111) << 4) | (opcode & 0b00001111);
+    size_t offset = 2;
+    // The mask bit is always set for frames we send
+    if (length <= 125) {
+        out[1] = 0b10000000 | (uint8_t)length;
+    }
+    else if (length <= 0xffff) {
+        out[1] = 0b10000000 | 126;
+        out[2] = (uint8_t)(length >> 8);
+        out[3] = (uint8_t)length;
+        offset = 4;
+    }
+    else {
+        out[1] = 0b10000000 | 127;
+        for (int i = 0; i < 8; i++) {
+            out[2 + i] = (uint8_t)(length >> (56 - 8 * i));
+        }
+        offset = 10;
+    }
+    memcpy(out + offset, mask, 4);
+    return offset + 4;
+}
+
+}
+
+#endif // WSFRAME_HPP
@@ -0,0 +1,183 @@
+#ifndef WSHANDSHAKE_HPP
+#define WSHANDSHAKE_HPP
+
+// The server's half of the opening handshake for simplews.hpp: an incremental parser for the
+// HTTP upgrade response, and the SHA-1 needed to check its Sec-WebSocket-Accept.
+
+#include <cctype>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace simplews {
+
+// SHA-1 (FIPS 180-4).  Broken for signatures, but it is what RFC 6455 uses to prove the server
+// read our key.
+inline std::string sha1(const std::string& input) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    auto rotl = [](uint32_t value, int bits) { return (value << bits) | (value >> (32 - bits)); };
+
+    // Pad with a 1 bit, zeros, then the length in bits to a multiple of 64 bytes
+    std::string data = input;
+    uint64_t bitLength = (uint64_t)input.size() * 8;
+    data += (char)0x80;
+    while (data.size() % 64 != 56) data += (char)0;
+    for (int i = 7; i >= 0; i--) data += (char)(bitLength >> (i * 8));
+
+    for (size_t block = 0; block < data.size(); block += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            const uint8_t* p = (const uint8_t*)data.data() + block + i * 4;
+            w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+            uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = temp;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    std::string digest(20, '\0');
+    for (int i = 0; i < 20; i++) {
+        digest[i] = (char)(h[i / 4] >> (24 - (i % 4) * 8));
+    }
+    return digest;
+}
+
+// What the server must hash our Sec-WebSocket-Key with
+static const char* const websocket_guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// Parses the upgrade response as it arrives, however the server's writes were split up.  The
+// response ends at the first blank line; anything after it is already WebSocket frames.
+class HandshakeResponse {
+public:
+    enum class Result {
+        DONE,         // The whole response has been read
+        NEED_MORE,    // Read some more and feed it in
+        BAD_RESPONSE  // Not an HTTP response, or too long to be a sane one
+    };
+
+    explicit HandshakeResponse(size_t maxLength = 16 * 1024) : maxLength(maxLength) {}
+
+    // Feed the next bytes from the socket.  On DONE, used is set to how many of them belonged to
+    // the response; the rest should go to the frame decoder.
+    Result feed(const char* data, size_t length, size_t* used) {
+        size_t before = text.size();
+        text.append(data, length);
+
+        // The terminator may straddle two reads, so look back a little
+        size_t end = text.find("\r\n\r\n", before >= 3 ? before - 3 : 0);
+        if (end == std::string::npos) {
+            if (text.size() > maxLength) return Result::BAD_RESPONSE;
+            return Result::NEED_MORE;
+        }
+        size_t headerLength = end + 4;
+        *used = headerLength - before;
+        text.resize(headerLength);
+        return parse() ? Result::DONE : Result::BAD_RESPONSE;
+    }
+
+    int status() const { return statusCode; }
+
+    // Value of a header (names compare case-insensitively), repeats joined with ", ", empty if missing
+    std::string header(const std::string& name) const {
+        std::string value;
+        for (const auto& field : headers) {
+            if (!equals_ignore_case(field.first, name)) continue;
+            if (!value.empty()) value += ", ";
+            value += field.second;
+        }
+        return value;
+    }
+
+    // A proper 101 for a WebSocket upgrade that answers the key we sent
+    bool is_upgrade(const std::string& expectedAccept) const {
+        if (statusCode != 101) return false;
+        if (!equals_ignore_case(header("Upgrade"), "websocket")) return false;
+        if (!has_token(header("Connection"), "upgrade")) return false;
+        return header("Sec-WebSocket-Accept") == expectedAccept;
+    }
+
+private:
+    bool parse() {
+        // Status line: HTTP/1.1 101 Switching Protocols
+        size_t lineEnd = text.find("\r\n");
+        if (text.compare(0, 5, "HTTP/") != 0) return false;
+        size_t space = text.find(' ');
+        if (space == std::string::npos || space > lineEnd || space + 4 > lineEnd) return false;
+        statusCode = 0;
+        for (size_t i = space + 1; i < space + 4; i++) {
+            if (text[i] < '0' || text[i] > '9') return false;
+            statusCode = statusCode * 10 + (text[i] - '0');
+        }
+
+        size_t lineStart = lineEnd + 2;
+        while (lineStart < text.size()) {
+            lineEnd = text.find("\r\n", lineStart);
+            if (lineEnd == lineStart) break;  // The blank line
+            size_t colon = text.find(':', lineStart);
+            if (colon == std::string::npos || colon > lineEnd) return false;
+            std::string name = text.substr(lineStart, colon - lineStart);
+            size_t valueStart = text.find_first_not_of(" \t", colon + 1);
+            size_t valueEnd = text.find_last_not_of(" \t", lineEnd - 1);
+            std::string value;
+            if (valueStart < lineEnd && valueEnd != std::string::npos && valueEnd >= valueStart) {
+                value = text.substr(valueStart, valueEnd - valueStart + 1);
+            }
+            headers.emplace_back(std::move(name), std::move(value));
+            lineStart = lineEnd + 2;
+        }
+        return true;
+    }
+
+    static bool equals_ignore_case(const std::string& a, const std::string& b) {
+        if (a.size() != b.size()) return false;
+        for (size_t i = 0; i < a.size(); i++) {
+            if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+        }
+        return true;
+    }
+
+    // Is token one of the comma separated values in list?
+    static bool has_token(const std::string& list, const std::string& token) {
+        size_t start = 0;
+        while (start <= list.size()) {
+            size_t end = list.find(',', start);
+            if (end == std::string::npos) end = list.size();
+            size_t first = list.find_first_not_of(" \t", start);
+            size_t last = list.find_last_not_of(" \t", end - 1);
+            if (first < end && last != std::string::npos && last >= first &&
+                equals_ignore_case(list.substr(first, last - first + 1), token)) {
+                return true;
+            }
+            start = end + 1;
+        }
+        return false;
+    }
+
+    size_t maxLength;
+    std::string text;
+    int statusCode = 0;
+    std::vector<std::pair<std::string, std::string>> headers;
+};
+
+}
+
+#endif // WSHANDSHAKE_HPP
@@ -0,0 +1,142 @@
+#ifndef WSMASK_HPP
+#define WSMASK_HPP
+
+// The WebSocket masking kernel: XOR a payload with a repeating 4 byte key.
+//
+// On x86-64 there are SSE2 (16 bytes per step) and AVX2 (32 bytes per step) versions picked
+// at runtime from what the CPU supports, everything else uses a word-at-a-time fallback.
+// The same kernel masks outgoing frames and unmasks any masked frame we receive.
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SIMPLEWS_MASK_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SIMPLEWS_TARGET_AVX2
+#else
+#define SIMPLEWS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace simplews {
+namespace detail {
+
+// The key as it lines up with a payload that starts phase bytes into it
+inline uint32_t rotate_mask(const uint8_t mask[4], size_t phase) {
+    uint8_t rotated[4];
+    for (size_t i = 0; i < 4; i++) {
+        rotated[i] = mask[(i + phase) & 3];
+    }
+    uint32_t key;
+    memcpy(&key, rotated, sizeof(key));
+    return key;
+}
+
+inline void mask_bytes(uint8_t* dst, const uint8_t* src, size_t length, const uint8_t mask[4], size_t phase) {
+    for (size_t i = 0; i < length; i++) {
+        dst[i] = src[i] ^ mask[(i + phase) & 3];
+    }
+}
+
+// Portable version, 8 bytes at a time
+inline void mask_scalar(uint8_t* dst, const uint8_t* src, size_t length, const uint8_t mask[4], size_t phase) {
+    uint32_t key32 = rotate_mask(mask, phase);
+    uint64_t key = ((uint64_t)key32 << 32) | key32;
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, src + i, sizeof(word));
+        word ^= key;
+        memcpy(dst + i, &word, sizeof(word));
+    }
+    // i is a multiple of 8, so the tail starts back at the same phase
+    mask_bytes(dst + i, src + i, length - i, mask, phase);
+}
+
+#ifdef SIMPLEWS_MASK_X86
+
+// Bytes to handle one at a time before dst reaches the given alignment
+inline size_t head_length(const uint8_t* dst, size_t alignment, size_t length) {
+    size_t head = (size_t)(-(intptr_t)dst) & (alignment - 1);
+    return head < length ? head : length;
+}
+
+inline void mask_sse2(uint8_t* dst, const uint8_t* src, size_t length, const uint8_t mask[4], size_t phase) {
+    size_t head = head_length(dst, 16, length);
+    mask_bytes(dst, src, head, mask, phase);
+    phase += head;
+
+    const __m128i key = _mm_set1_epi32((int)rotate_mask(mask, phase));
+    size_t i = head;
+    for (; i + 16 <= length; i += 16) {
+        __m128i data = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_store_si128((__m128i*)(dst + i), _mm_xor_si128(data, key));
+    }
+    mask_bytes(dst + i, src + i, length - i, mask, phase);
+}
+
+SIMPLEWS_TARGET_AVX2
+inline void mask_avx2(uint8_t* dst, const uint8_t* src, size_t length, const uint8_t mask[4], size_t phase) {
+    size_t head = head_length(dst, 32, length);
+    mask_bytes(dst, src, head, mask, phase);
+    phase += head;
+
+    const __m256i key = _mm256_set1_epi32((int)rotate_mask(mask, phase));
+    size_t i = head;
+    for (; i + 32 <= length; i += 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_store_si256((__m256i*)(dst + i), _mm256_xor_si256(data, key));
+    }
+    mask_bytes(dst + i, src + i, length - i, mask, phase);
+}
+
+inline bool cpu_has_avx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave || (_xgetbv(0) & 0x6) != 0x6) return false;  // The OS has to save the ymm registers
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // SIMPLEWS_MASK_X86
+
+using MaskFunction = void (*)(uint8_t*, const uint8_t*, size_t, const uint8_t*, size_t);
+
+inline MaskFunction select_mask_function() {
+#ifdef SIMPLEWS_MASK_X86
+    if (cpu_has_avx2()) return mask_avx2;
+    return mask_sse2;  // Always there on x86-64
+#else
+    return mask_scalar;
+#endif
+}
+
+}
+
+// XOR src with the repeating 4 byte mask into dst (which may be the same as src).
+// phase is how far into the mask the first byte sits, for payloads processed in pieces.
+inline void apply_mask(uint8_t* dst, const uint8_t* src, size_t length, const uint8_t mask[4], size_t phase = 0) {
+    // Short payloads aren't worth the vector setup
+    if (length < 32) {
+        detail::mask_bytes(dst, src, length, mask, phase);
+        return;
+    }
+    static const detail::MaskFunction maskFunction = detail::select_mask_function();
+    maskFunction(dst, src, length, mask, phase & 3);
+}
+
+}
+
+#endif // WSMASK_HPP
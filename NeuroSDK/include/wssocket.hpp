@@ -0,0 +1,251 @@
+#ifndef WSSOCKET_HPP
+#define WSSOCKET_HPP
+
+// Socket setup for simplews.hpp: TCP tuning, and unix domain sockets for a server on the same host.
+//
+// The TCP options are applied to every socket a connect tries, before connect() itself, so the
+// buffer sizes are in place in time to shape the window scale agreed in the SYN.  Options the
+// platform doesn't have are skipped; options the kernel refuses are reported and the connect
+// carries on without them.
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+namespace simplews {
+
+#ifdef _WIN32
+using native_socket = SOCKET;
+#else
+using native_socket = int;
+#endif
+
+struct SocketOptions {
+    // Turn Nagle off, so small messages (action results, contexts) go out straight away instead
+    // of waiting for the previous segment to be acknowledged
+    bool noDelay = true;
+
+    // Kernel send and receive buffer sizes in bytes, 0 leaves the system default (and autotuning)
+    int sendBufferSize = 0;
+    int receiveBufferSize = 0;
+
+    // (Linux) Acknowledge every segment at once instead of delaying ACKs.  The kernel drops back to
+    // delayed ACKs by itself, so this is set again after every read.
+    bool quickAck = false;
+
+    // (Linux) Busy poll the device queue for up to this many microseconds on a blocking read, 0 is off.
+    // Values above net.core.busy_poll need CAP_NET_ADMIN.
+    int busyPollMicroseconds = 0;
+
+    // TCP keepalive, so a silently dead peer is noticed even when we have nothing to send.
+    // The times and count are left to the system when 0.
+    bool keepAlive = false;
+    int keepAliveIdleSeconds = 0;      // Idle time before the first probe
+    int keepAliveIntervalSeconds = 0;  // Between probes
+    int keepAliveCount = 0;            // Unanswered probes before the connection is dropped
+
+    // (Linux) Drop the connection if sent data stays unacknowledged this long, 0 is the system default
+    unsigned userTimeoutMilliseconds = 0;
+};
+
+namespace detail {
+
+inline bool set_option(native_socket fd, int level, int name, int value, const char* what) {
+    if (setsockopt(fd, level, name, (const char*)&value, sizeof(value)) == 0) return true;
+#ifdef _WIN32
+    std::cerr << "Failed to set " << what << ": " << WSAGetLastError() << std::endl;
+#else
+    std::cerr << "Failed to set " << what << ": " << strerror(errno) << std::endl;
+#endif
+    return false;
+}
+
+}
+
+// Apply options to a TCP socket, returns false if any of them couldn't be set
+inline bool apply_socket_options(native_socket fd, const SocketOptions& options) {
+    bool ok = true;
+    if (options.noDelay) {
+        ok &= detail::set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (options.sendBufferSize > 0) {
+        ok &= detail::set_option(fd, SOL_SOCKET, SO_SNDBUF, options.sendBufferSize, "SO_SNDBUF");
+    }
+    if (options.receiveBufferSize > 0) {
+        ok &= detail::set_option(fd, SOL_SOCKET, SO_RCVBUF, options.receiveBufferSize, "SO_RCVBUF");
+    }
+#ifdef TCP_QUICKACK
+    if (options.quickAck) {
+        ok &= detail::set_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    }
+#endif
+#ifdef SO_BUSY_POLL
+    if (options.busyPollMicroseconds > 0) {
+        ok &= detail::set_option(fd, SOL_SOCKET, SO_BUSY_POLL, options.busyPollMicroseconds, "SO_BUSY_POLL");
+    }
+#endif
+    if (options.keepAlive) {
+        ok &= detail::set_option(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+#ifdef TCP_KEEPIDLE
+        if (options.keepAliveIdleSeconds > 0) {
+            ok &= detail::set_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, options.keepAliveIdleSeconds, "TCP_KEEPIDLE");
+        }
+#endif
+#ifdef TCP_KEEPINTVL
+        if (options.keepAliveIntervalSeconds > 0) {
+            ok &= detail::set_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, options.keepAliveIntervalSeconds, "TCP_KEEPINTVL");
+        }
+#endif
+#ifdef TCP_KEEPCNT
+        if (options.keepAliveCount > 0) {
+            ok &= detail::set_option(fd, IPPROTO_TCP, TCP_KEEPCNT, options.keepAliveCount, "TCP_KEEPCNT");
+        }
+#endif
+    }
+#ifdef TCP_USER_TIMEOUT
+    if (options.userTimeoutMilliseconds > 0) {
+        ok &= detail::set_option(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, (int)options.userTimeoutMilliseconds, "TCP_USER_TIMEOUT");
+    }
+#endif
+    return ok;
+}
+
+// Who is on the other end of a unix domain socket
+struct PeerCredentials {
+    long pid = 0;   // 0 where the platform doesn't say
+    unsigned uid = 0;
+    unsigned gid = 0;
+};
+
+// Decides whether to talk to a unix socket's peer.  Without one, only a peer running as our own
+// user (or root) is accepted, so another user's process can't pose as the server.
+using PeerCheck = std::function<bool(const PeerCredentials&)>;
+
+#ifndef _WIN32
+inline bool peer_credentials(native_socket fd, PeerCredentials* credentials) {
+#ifdef SO_PEERCRED
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0) return false;
+    credentials->pid = peer.pid;
+    credentials->uid = peer.uid;
+    credentials->gid = peer.gid;
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) != 0) return false;
+    credentials->pid = 0;
+    credentials->uid = uid;
+    credentials->gid = gid;
+#endif
+    return true;
+}
+
+namespace detail {
+
+// Connect without blocking past deadline.  A listener whose backlog is full makes a blocking
+// connect wait, and a non-blocking one fail with EAGAIN (Linux) or go EINPROGRESS (elsewhere),
+// so the first is retried and the second polled until the deadline.
+inline bool connect_unix_until(native_socket fd, const struct sockaddr_un& address, std::chrono::steady_clock::time_point deadline) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) return false;
+    auto left = [deadline]() {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        return ms < 0 ? 0 : (int)(std::min)((long long)ms, (long long)INT_MAX);
+    };
+    bool connected = false;
+    while (true) {
+        if (::connect(fd, (const struct sockaddr*)&address, sizeof(address)) == 0) {
+            connected = true;
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN && left() > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds((std::min)(10, left())));
+            continue;
+        }
+        if (errno == EINPROGRESS) {
+            struct pollfd entry = {};
+            entry.fd = fd;
+            entry.events = POLLOUT;
+            int ready;
+            do {
+                ready = ::poll(&entry, 1, left());
+            } while (ready < 0 && errno == EINTR);
+            int error = 0;
+            socklen_t length = sizeof(error);
+            connected = ready > 0 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+        }
+        break;
+    }
+    return connected && fcntl(fd, F_SETFL, flags) == 0;
+}
+
+}
+
+// Connect a stream socket to path, giving up at deadline, and check who is listening on it.
+// Returns -1 on failure.
+inline native_socket open_unix_socket(const std::string& path, const SocketOptions& options, const PeerCheck& check, std::chrono::steady_clock::time_point deadline) {
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) return -1;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    native_socket fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    // Only the buffer sizes mean anything without TCP
+    if (options.sendBufferSize > 0) {
+        detail::set_option(fd, SOL_SOCKET, SO_SNDBUF, options.sendBufferSize, "SO_SNDBUF");
+    }
+    if (options.receiveBufferSize > 0) {
+        detail::set_option(fd, SOL_SOCKET, SO_RCVBUF, options.receiveBufferSize, "SO_RCVBUF");
+    }
+    if (!detail::connect_unix_until(fd, address, deadline)) {
+        ::close(fd);
+        return -1;
+    }
+
+    PeerCredentials peer;
+    bool allowed = peer_credentials(fd, &peer) &&
+        (check ? check(peer) : (peer.uid == geteuid() || peer.uid == 0));
+    if (!allowed) {
+        std::cerr << "Refusing to talk to " << path << ", its owner isn't trusted." << std::endl;
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+// TCP_QUICKACK doesn't stick, call after each read to keep it on (no-op elsewhere)
+inline void rearm_quick_ack(native_socket fd) {
+#ifdef TCP_QUICKACK
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+#else
+    (void)fd;
+#endif
+}
+
+}
+
+#endif // WSSOCKET_HPP
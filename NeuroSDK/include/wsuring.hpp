@@ -0,0 +1,279 @@
+#ifndef WSURING_HPP
+#define WSURING_HPP
+
+// io_uring transport for simplews.hpp (Linux only).
+//
+// Needs liburing (2.4 or newer) and a 6.0+ kernel, so it is only compiled in when
+// SIMPLEWS_WITH_URING is defined (and liburing is linked).  Once a connection has finished its
+// handshake the socket is handed to two rings:
+//   - the receive ring keeps a single multishot recv armed that picks its buffers out of a
+//     registered buffer ring, so a steady stream of frames costs no submissions at all and a
+//     whole batch of completions is reaped with one peek.
+//   - the send ring takes a gather write as a chain of linked sends (one per slice), submitted
+//     and waited for with a single io_uring_enter.
+// The ring fd becomes readable when completions are waiting, so an event loop can watch it in
+// place of the socket.
+//
+// The kernel finishes each receive on the thread that submitted it, and cancels it if that thread
+// exits, so the recv is only armed by the first receive() call rather than by start(); that way
+// it belongs to whichever thread actually reads, not to the one that happened to connect.
+
+#ifndef __linux__
+#error "io_uring is only available on Linux, don't define SIMPLEWS_WITH_URING for this platform"
+#endif
+
+#include <liburing.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include "wsframe.hpp"
+
+namespace simplews {
+
+class UringTransport {
+public:
+    UringTransport() {}
+    ~UringTransport() { stop(); }
+
+    bool active() const { return started; }
+
+    // Readable whenever receive() has something to hand over
+    int event_fd() const { return recvRing.ring_fd; }
+
+    // Take over a connected socket.  bufferCount must be a power of two.
+    bool start(int fd, unsigned bufferCount = 64, size_t bufferSize = 16 * 1024) {
+        stop();
+        socketFd = fd;
+        bufferEntries = bufferCount;
+        entrySize = bufferSize;
+
+        if (!init_ring(recvRing, 8)) return false;
+        if (!init_ring(sendRing, maxLinkedSends)) {
+            io_uring_queue_exit(&recvRing);
+            return false;
+        }
+
+        int result = 0;
+        bufferRing = io_uring_setup_buf_ring(&recvRing, bufferEntries, bufferGroup, 0, &result);
+        if (!bufferRing) {
+            io_uring_queue_exit(&sendRing);
+            io_uring_queue_exit(&recvRing);
+            return false;
+        }
+        buffers.resize(bufferEntries * entrySize);
+        int mask = io_uring_buf_ring_mask(bufferEntries);
+        for (unsigned id = 0; id < bufferEntries; id++) {
+            io_uring_buf_ring_add(bufferRing, buffer(id), (unsigned)entrySize, (unsigned short)id, mask, (int)id);
+        }
+        io_uring_buf_ring_advance(bufferRing, (int)bufferEntries);
+
+        started = true;
+        armed = false;
+        finished = false;
+        finishError = 0;
+        return true;
+    }
+
+    // Copy whatever has been received into the decoder's buffer, waiting for something if wait is
+    // set.  Returns the byte count, 0 once the peer has closed, or -1 with errno set (EAGAIN if
+    // nothing has arrived and we weren't to wait).  drained is set if no completions are left.
+    int receive(ReceiveBuffer& into, bool wait, bool* drained) {
+        if (!armed && !finished) {
+            if (!arm_receive() || io_uring_submit(&recvRing) < 0) {
+                errno = EIO;
+                return -1;
+            }
+            armed = true;
+        }
+        for (;;) {
+            struct io_uring_cqe* cqes[maxBatch];
+            unsigned count = io_uring_peek_batch_cqe(&recvRing, cqes, maxBatch);
+            if (count == 0) {
+                if (finished) return finish();
+                if (!wait) {
+                    errno = EAGAIN;
+                    return -1;
+                }
+                struct io_uring_cqe* cqe;
+                int result;
+                do {
+                    result = io_uring_wait_cqe(&recvRing, &cqe);
+                } while (result == -EINTR);
+                if (result < 0) {
+                    errno = -result;
+                    return -1;
+                }
+                continue;
+            }
+
+            size_t total = 0;
+            int recycled = 0;
+            bool rearm = false;
+            int mask = io_uring_buf_ring_mask(bufferEntries);
+            for (unsigned i = 0; i < count; i++) {
+                struct io_uring_cqe* cqe = cqes[i];
+                if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                    unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                    memcpy(into.prepare(cqe->res), buffer(id), cqe->res);
+                    into.commit(cqe->res);
+                    total += cqe->res;
+                    // Straight back into the ring for the next read
+                    io_uring_buf_ring_add(bufferRing, buffer(id), (unsigned)entrySize, (unsigned short)id, mask, recycled++);
+                } else if (cqe->res == 0) {
+                    finished = true;  // Orderly shutdown from the peer
+                } else if (cqe->res != -ENOBUFS) {
+                    // Running out of buffers just ends the multishot, anything else is fatal
+                    finished = true;
+                    finishError = -cqe->res;
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE)) rearm = true;
+            }
+            if (recycled) io_uring_buf_ring_advance(bufferRing, recycled);
+            io_uring_cq_advance(&recvRing, count);
+
+            if (rearm && !finished) {
+                if (!arm_receive() || io_uring_submit(&recvRing) < 0) {
+                    finished = true;
+                    finishError = EIO;
+                }
+            }
+
+            if (total > 0) {
+                // Data that arrived ahead of a close is handed over first, the close comes next call
+                if (drained) *drained = io_uring_cq_ready(&recvRing) == 0;
+                return (int)total;
+            }
+            if (finished) return finish();
+        }
+    }
+
+    // Write the iovecs in order as a chain of linked sends.  Returns how many bytes went out
+    // (which may stop short part way through the chain) or -1 with errno set.
+    ssize_t send(const struct iovec* parts, size_t count) {
+        unsigned batch = (unsigned)(count < maxLinkedSends ? count : maxLinkedSends);
+        for (unsigned i = 0; i < batch; i++) {
+            struct io_uring_sqe* sqe = io_uring_get_sqe(&sendRing);
+            // MSG_WAITALL makes the kernel retry short sends rather than break the chain
+            io_uring_prep_send(sqe, socketFd, parts[i].iov_base, parts[i].iov_len, MSG_WAITALL | MSG_NOSIGNAL);
+            io_uring_sqe_set_data64(sqe, i);
+            if (i + 1 < batch) sqe->flags |= IOSQE_IO_LINK;
+        }
+
+        int submitted;
+        do {
+            submitted = io_uring_submit_and_wait(&sendRing, batch);
+        } while (submitted == -EINTR);
+        if (submitted < 0) {
+            errno = -submitted;
+            return -1;
+        }
+
+        // Reap every completion of the chain before looking at the results
+        int results[maxLinkedSends];
+        unsigned seen = 0;
+        while (seen < batch) {
+            struct io_uring_cqe* cqes[maxLinkedSends];
+            unsigned ready = io_uring_peek_batch_cqe(&sendRing, cqes, maxLinkedSends);
+            if (ready == 0) {
+                struct io_uring_cqe* cqe;
+                int result = io_uring_wait_cqe(&sendRing, &cqe);
+                if (result < 0 && result != -EINTR) {
+                    errno = -result;
+                    return -1;
+                }
+                continue;
+            }
+            for (unsigned i = 0; i < ready; i++) {
+                results[io_uring_cqe_get_data64(cqes[i])] = cqes[i]->res;
+            }
+            io_uring_cq_advance(&sendRing, ready);
+            seen += ready;
+        }
+
+        // Count the unbroken run of bytes from the start, a short send cancels the rest of the chain
+        size_t sent = 0;
+        for (unsigned i = 0; i < batch; i++) {
+            if (results[i] < 0) {
+                if (sent == 0) {
+                    errno = results[i] == -ECANCELED ? EPIPE : -results[i];
+                    return -1;
+                }
+                break;
+            }
+            sent += (size_t)results[i];
+            if ((size_t)results[i] < parts[i].iov_len) break;
+        }
+        if (sent == 0 && batch > 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        return (ssize_t)sent;
+    }
+
+    // Tear both rings down (which cancels anything in flight).  The socket is left to the caller.
+    void stop() {
+        if (!started) return;
+        io_uring_free_buf_ring(&recvRing, bufferRing, bufferEntries, bufferGroup);
+        bufferRing = nullptr;
+        io_uring_queue_exit(&sendRing);
+        io_uring_queue_exit(&recvRing);
+        recvRing.ring_fd = -1;
+        started = false;
+    }
+
+    UringTransport(const UringTransport&) = delete;
+    UringTransport& operator=(const UringTransport&) = delete;
+
+private:
+    static constexpr unsigned maxBatch = 32;
+    static constexpr unsigned maxLinkedSends = 16;
+    static constexpr int bufferGroup = 0;
+
+    uint8_t* buffer(unsigned id) { return buffers.data() + (size_t)id * entrySize; }
+
+    // No IORING_SETUP_COOP_TASKRUN: the ring fd would then only become readable after we next
+    // entered the kernel ourselves, which an event loop sat in epoll_wait never does
+    static bool init_ring(struct io_uring& ring, unsigned entries) {
+        return io_uring_queue_init(entries, &ring, 0) == 0;
+    }
+
+    bool arm_receive() {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&recvRing);
+        if (!sqe) return false;
+        io_uring_prep_recv_multishot(sqe, socketFd, nullptr, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = bufferGroup;
+        io_uring_sqe_set_data64(sqe, 0);
+        return true;
+    }
+
+    int finish() {
+        if (finishError == 0) return 0;
+        errno = finishError;
+        return -1;
+    }
+
+    struct io_uring recvRing = {};
+    struct io_uring sendRing = {};
+    struct io_uring_buf_ring* bufferRing = nullptr;
+    std::vector<uint8_t> buffers;
+    unsigned bufferEntries = 0;
+    size_t entrySize = 0;
+    int socketFd = -1;
+    bool started = false;
+    bool armed = false;
+
+    // The receive side has seen the end of the stream (finishError is 0 for an orderly close)
+    bool finished = false;
+    int finishError = 0;
+};
+
+}
+
+#endif // WSURING_HPP
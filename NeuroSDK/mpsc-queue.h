@@ -0,0 +1,63 @@
+#pragma once
+// An unbounded queue for any number of producer threads and one consumer (Dmitry Vyukov's
+// node based MPSC queue).
+//
+// A push is one allocation and one atomic exchange, it never waits on another thread; the
+// consumer never takes a lock either.  The one catch: a producer that has been preempted between
+// its exchange and linking its node in hides everything pushed after it until it resumes, so pop()
+// can briefly say empty while pushes have completed.  Whatever was missed is there on a later pop().
+
+#include <atomic>
+#include <utility>
+
+namespace neuro {
+
+template<typename T>
+class MpscQueue {
+public:
+    MpscQueue() : head(new Node()), tail(head.load()) {}
+
+    ~MpscQueue() {
+        T discard;
+        while (pop(discard)) {}
+        delete tail;
+    }
+
+    // Any thread
+    void push(T value) {
+        Node *node = new Node();
+        node->value = std::move(value);
+        Node *previous = head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    // The consumer thread only, false if there is nothing (visible) to take
+    bool pop(T &value) {
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (!next) return false;
+        value = std::move(next->value);
+        delete tail;
+        tail = next;  // The node just emptied becomes the new stub
+        return true;
+    }
+
+    // The consumer thread only
+    bool empty() const {
+        return tail->next.load(std::memory_order_acquire) == nullptr;
+    }
+
+    // Disallow copy and asignment operators
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+private:
+    struct Node {
+        std::atomic<Node*> next{ nullptr };
+        T value;
+    };
+
+    alignas(64) std::atomic<Node*> head;  // Producers swap themselves in here
+    alignas(64) Node *tail;               // Consumer's end, always a stub whose value is spent
+};
+
+}
@@ -0,0 +1,208 @@
+#pragma once
+// co_await a forced action (C++20).
+//
+// forceAction() only sends the force; the answer turns up later as a call to the chosen action's
+// onAction(), wherever that happens to run.  With sdk.force() a coroutine waits for the answer
+// instead and carries on with it, so a turn reads top to bottom:
+//
+//     neuro::Task takeTurn(neuro::NeuroSDK &sdk, neuro::ResumeQueue &onGameThread) {
+//         std::vector<std::string> offered{ "play" };  // GCC 12 can't take a braced list inside co_await
+//         neuro::ForcedAction move = co_await sdk.force("Your turn", "Pick a cell", offered, &onGameThread);
+//         if (!move) co_return;  // The force couldn't be sent, or the SDK disconnected
+//         bool ok = board.play(move.parameters()["cell"]);
+//         move.reply(ok, ok ? "Placed" : "That cell is taken");
+//     }
+//
+// The actions offered still have to be registered.  An answer goes to the oldest waiting force
+// that offered the action, and only when none did to the action's onAction().  Waiting costs the
+// coroutine's frame and nothing else: the awaiter lives in that frame and is linked straight into
+// the SDK's list of pending forces, there is no thread or callback per force.  The coroutine is
+// resumed through the Executor given to force(), or without one on whichever thread received the
+// answer (the receive thread or event loop), which is then held up until the coroutine next suspends.
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include "neuro-sdk.hpp"
+
+#include <coroutine>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace neuro {
+
+// Somewhere to resume a coroutine
+class Executor {
+public:
+    virtual void resume(std::coroutine_handle<> handle) = 0;
+
+protected:
+    ~Executor() = default;
+};
+
+// Resumes coroutines on whichever thread calls poll(), typically the game loop once a frame.
+// Coroutines still queued when it is destroyed are never resumed.
+class ResumeQueue final : public Executor {
+public:
+    void resume(std::coroutine_handle<> handle) override { queue.push(handle); }
+
+    // From one thread only, returns how many coroutines were resumed
+    size_t poll(size_t maxItems = (std::numeric_limits<size_t>::max)()) {
+        size_t resumed = 0;
+        std::coroutine_handle<> handle;
+        while (resumed < maxItems && queue.pop(handle)) {
+            handle.resume();
+            resumed++;
+        }
+        return resumed;
+    }
+
+private:
+    MpscQueue<std::coroutine_handle<>> queue;
+};
+
+// Resumes coroutines on a HandlerPool's workers
+class PoolExecutor final : public Executor {
+public:
+    explicit PoolExecutor(HandlerPool &pool) : pool(pool) {}
+    void resume(std::coroutine_handle<> handle) override { pool.post([handle]() { handle.resume(); }); }
+
+private:
+    HandlerPool &pool;
+};
+
+// The action Neuro picked for a force.  Answer it with reply(); if it goes out of scope unanswered
+// a failed result is sent for it, so Neuro is never left waiting.  Don't keep it past the SDK.
+class ForcedAction {
+public:
+    ForcedAction() = default;
+    ForcedAction(ForcedAction &&other) noexcept
+        : sdk(std::exchange(other.sdk, nullptr)), action(std::move(other.action)), replied(other.replied) {}
+    ForcedAction &operator=(ForcedAction &&other) noexcept {
+        if (this != &other) {
+            finish();
+            sdk = std::exchange(other.sdk, nullptr);
+            action = std::move(other.action);
+            replied = other.replied;
+        }
+        return *this;
+    }
+    ~ForcedAction() { finish(); }
+
+    // False if there is no answer: the force couldn't be sent, or the SDK disconnected first
+    explicit operator bool() const { return !action.is_null(); }
+
+    const std::string &name() const { return action["name"].get_ref<const std::string&>(); }
+
+    // The action command's data, as onAction() would have been given it
+    const json &data() const { return action; }
+
+    // What Neuro filled the action's schema in with (sent as a JSON string), an empty object if nothing
+    json parameters() const {
+        auto it = action.find("data");
+        if (it == action.end() || it->is_null()) return json::object();
+        return it->is_string() ? json::parse(it->get_ref<const std::string&>()) : *it;
+    }
+
+    // Send the action/result, only the first call counts
+    bool reply(bool success, const std::string &message) {
+        if (!sdk || replied) return false;
+        replied = true;
+        return sdk->sendCommand(sdk->resultCommand(action["id"], success, message));
+    }
+
+    ForcedAction(const ForcedAction&) = delete;
+    ForcedAction& operator=(const ForcedAction&) = delete;
+
+private:
+    friend class ForceAwaiter;
+    ForcedAction(NeuroSDK *sdk, json action) : sdk(sdk), action(std::move(action)) {}
+
+    void finish() {
+        if (sdk && !replied && !action.is_null()) reply(false, "The game didn't handle the action");
+    }
+
+    NeuroSDK *sdk = nullptr;
+    json action;
+    bool replied = false;
+};
+
+// What sdk.force() returns, only good for co_await-ing once
+class ForceAwaiter : private PendingForce {
+public:
+    bool await_ready() const noexcept { return false; }
+
+    // The force is queued for the answer before it is sent, so the answer can't slip past us
+    bool await_suspend(std::coroutine_handle<> awaiting) {
+        handle = awaiting;
+        // Once sent we may be resumed (and this frame moved on) at any moment, so nothing of ours
+        // is touched after forceAction() returns true
+        NeuroSDK *target = sdk;
+        target->addPendingForce(this);
+        // Sent as an awaited force, which a later force can't replace in the queue
+        if (target->sendCommand(target->forceCommand(std::move(gameState), std::move(whatToDo), actions), CommandKind::AwaitedForce)) {
+            return true;
+        }
+        // Nothing was sent, so nothing will answer: carry straight on with an empty result
+        return !target->cancelPendingForce(this);
+    }
+
+    ForcedAction await_resume() {
+        return action.is_null() ? ForcedAction() : ForcedAction(sdk, std::move(action));
+    }
+
+    ForceAwaiter(const ForceAwaiter&) = delete;
+    ForceAwaiter& operator=(const ForceAwaiter&) = delete;
+
+private:
+    friend class NeuroSDK;
+    ForceAwaiter(NeuroSDK *sdk, std::string gameState, std::string whatToDo, std::vector<std::string> listOfActions, Executor *executor)
+        : sdk(sdk), executor(executor), gameState(std::move(gameState)), whatToDo(std::move(whatToDo)) {
+        actions = std::move(listOfActions);
+    }
+
+    void resume() override {
+        if (executor) {
+            executor->resume(handle);
+        } else {
+            handle.resume();
+        }
+    }
+
+    NeuroSDK *sdk;
+    Executor *executor;
+    std::string gameState;
+    std::string whatToDo;
+    std::coroutine_handle<> handle;
+};
+
+inline ForceAwaiter NeuroSDK::force(std::string gameState, std::string whatToDo, std::vector<std::string> listOfActions, Executor *executor) {
+    return ForceAwaiter(this, std::move(gameState), std::move(whatToDo), std::move(listOfActions), executor);
+}
+
+// A coroutine that starts straight away and cleans up after itself when it finishes, which is all
+// game logic that co_awaits Neuro needs.  Exceptions that escape it are reported and dropped.
+struct Task {
+    struct promise_type {
+        Task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept {
+            try {
+                throw;
+            } catch (const std::exception &e) {
+                std::cerr << "Error in coroutine: " << e.what() << std::endl;
+            } catch (...) {
+                std::cerr << "Error in coroutine." << std::endl;
+            }
+        }
+    };
+};
+
+}
+
+#endif // __cpp_impl_coroutine
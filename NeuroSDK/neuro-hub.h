@@ -0,0 +1,185 @@
+#pragma once
+// Many game sessions on a few threads (Linux only).
+//
+// A plain NeuroSDK has a receive thread of its own, which adds up fast when one process hosts
+// hundreds of games.  A NeuroHub owns a small fixed set of event loops, each run by one thread, and
+// every session it creates is a normal NeuroSDK pinned to one of them.  All of a session's messages
+// are handled on its loop's thread, so they are dispatched one at a time and in the order they
+// arrived; sessions on different loops run in parallel.
+//
+// Sending goes through each session's bounded queue (SDKOptions::useWriterThread), which its loop
+// drains: a send pushes the command and wakes the loop, and the loop writes whatever has queued up
+// in one go without waiting on the socket.  If the peer stalls the rest is written when EPOLLOUT
+// says there is room, and until then new commands stay in the queue where they are dropped or
+// merged, so neither a game thread nor the loop ever waits on one slow peer.  Pongs and pings are
+// queued the same way.  Reconnect backoff runs as timers on the loop, and only the blocking connect
+// attempt itself gets a thread, for as long as it takes.  Turning useWriterThread off has the
+// calling thread write, and wait, instead.
+//
+// The loops can be pinned one per CPU core.  A connection's receive buffers are only ever touched
+// by the thread of the loop it is on (they grow there, so they are first touched by that core
+// too), so receiving takes no locks shared between cores.  There is no allocator per loop: the
+// buffers already belong to their connection and are reused, so one would add nothing.  migrate()
+// moves a session to another loop when the load is uneven.
+
+#ifdef __linux__
+
+#include "neuro-sdk.hpp"
+#include "event-loop.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace neuro {
+
+class NeuroHub {
+    struct Slot;
+
+public:
+    // Deleting a session disconnects it (if still connected) and frees its place on the loop
+    struct SessionDeleter {
+        Slot *slot = nullptr;
+        void operator()(NeuroSDK *session) const {
+            delete session;
+            if (slot) slot->sessions--;
+        }
+    };
+    using Session = std::unique_ptr<NeuroSDK, SessionDeleter>;
+
+    // Run threads loops, 0 picks one per core
+    explicit NeuroHub(unsigned threads = 0) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        slots.reserve(threads);
+        for (unsigned i = 0; i < threads; i++) {
+            slots.emplace_back(new Slot());
+        }
+        startLoops({});
+    }
+
+    // One loop per listed CPU core, each thread pinned to its core
+    explicit NeuroHub(const std::vector<int> &cpus) {
+        if (cpus.empty()) {
+            throw std::invalid_argument("NeuroHub needs at least one CPU");
+        }
+        slots.reserve(cpus.size());
+        for (size_t i = 0; i < cpus.size(); i++) {
+            slots.emplace_back(new Slot());
+        }
+        startLoops(cpus);
+    }
+
+    // Every session has to be gone before the hub is, their sockets live on our loops
+    ~NeuroHub() {
+        for (auto &slot : slots) {
+            slot->loop.stop();
+        }
+        for (auto &slot : slots) {
+            if (slot->thread.joinable()) slot->thread.join();
+        }
+    }
+
+    // A new session on the least busy loop, use it exactly like a NeuroSDK (connect(), gameinit()...).
+    // The event loop settings in options are overridden, the rest are kept.  The loop is the writer,
+    // so a session adds no threads of its own.
+    Session createSession(const std::string &gameName, SDKOptions options = SDKOptions()) {
+        Slot *slot = leastBusy();
+        slot->sessions++;
+        options.useEventLoop = true;
+        options.eventLoop = &slot->loop;
+        return Session(new NeuroSDK(gameName, options), SessionDeleter{ slot });
+    }
+
+    // Move a session onto loop index (0 .. loopCount() - 1).  The session has to be connected and
+    // not using io_uring; see NeuroSDK::moveToLoop().  Don't disconnect it while this runs.
+    // Not from one of the hub's loops (a session's handlers): the move is only known to have
+    // happened once the session's loop has made it, and that loop may be the one we are on.
+    bool migrate(Session &session, size_t index) {
+        if (!session || index >= slots.size()) return false;
+        Slot *from = session.get_deleter().slot;
+        Slot *to = slots[index].get();
+        if (from == to) return true;
+        for (auto &slot : slots) {
+            if (slot->loop.isInLoopThread()) return false;
+        }
+        if (!session->moveToLoop(&to->loop)) return false;
+        to->sessions++;
+        if (from) from->sessions--;
+        session.get_deleter().slot = to;
+        return true;
+    }
+
+    // Which loop a session is on
+    size_t loopOf(const Session &session) const {
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (slots[i].get() == session.get_deleter().slot) return i;
+        }
+        return slots.size();
+    }
+
+    size_t loopCount() const { return slots.size(); }
+
+    // How many sessions each loop is serving
+    std::vector<size_t> sessionsPerLoop() const {
+        std::vector<size_t> counts;
+        counts.reserve(slots.size());
+        for (auto &slot : slots) {
+            counts.push_back(slot->sessions);
+        }
+        return counts;
+    }
+
+    // Disallow copy and asignment operators
+    NeuroHub(const NeuroHub&) = delete;
+    NeuroHub& operator=(const NeuroHub&) = delete;
+
+private:
+    struct Slot {
+        EventLoop loop;
+        std::thread thread;
+        std::atomic<size_t> sessions{ 0 };
+    };
+
+    void startLoops(const std::vector<int> &cpus) {
+        for (size_t i = 0; i < slots.size(); i++) {
+            EventLoop *loop = &slots[i]->loop;
+            slots[i]->thread = std::thread([loop]() { loop->run(); });
+            if (i < cpus.size()) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpus[i], &set);
+                if (pthread_setaffinity_np(slots[i]->thread.native_handle(), sizeof(set), &set) != 0) {
+                    std::cerr << "Couldn't pin event loop " << i << " to CPU " << cpus[i] << std::endl;
+                }
+            }
+        }
+    }
+
+    // Ties go round robin so a burst of new sessions still spreads out
+    Slot *leastBusy() {
+        size_t start = nextSlot++ % slots.size();
+        Slot *best = slots[start].get();
+        for (size_t i = 1; i < slots.size(); i++) {
+            Slot *slot = slots[(start + i) % slots.size()].get();
+            if (slot->sessions < best->sessions) best = slot;
+        }
+        return best;
+    }
+
+    std::vector<std::unique_ptr<Slot>> slots;
+    std::atomic<size_t> nextSlot{ 0 };
+};
+
+}
+
+#endif // __linux__
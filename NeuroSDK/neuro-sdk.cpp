@@ -1,6 +1,11 @@
 #include "include/nlohmann/json.hpp"
 #include "neuro-sdk.hpp" 
+#include "event-loop.h"
 #include <thread>
+#include <future>
+#include <random>
+#include <algorithm>
+#include <stdexcept>
 
 using json = nlohmann::json;
 
@@ -23,24 +28,122 @@ namespace neuro{
     }
 
     // Some basic con/de-structors
-    NeuroSDK::NeuroSDK(const std::string &gameName) : isConnected(false), gameName(gameName), ws() {}
+    NeuroSDK::NeuroSDK(const std::string &gameName, const SDKOptions &options) : isConnected(false), gameName(gameName), options(options), ws() {
+        auto merger = [](OutboundCommand &older, const OutboundCommand &newer) {
+            // Encoded once it is taken, however many times it was merged into
+            older.text += "\n";
+            older.text += newer.text;
+            older.message.clear();
+        };
+        outbound.configure(options.maxQueuedCommands, options.queueHighWater, options.contextOverflow, merger, options.onQueueHighWater);
+        // Commands held while reconnecting make room the same way
+        heldCommands.configure(options.maxHeldCommands, 0, options.contextOverflow, merger, nullptr);
+
+        handlers = options.handlerPool;
+        if (!handlers && options.handlerThreads > 0) {
+            ownHandlers.reset(new HandlerPool(options.handlerThreads));
+            handlers = ownHandlers.get();
+        }
+    }
 
     // Be a good citizen and clean up after ourselves.
     NeuroSDK::~NeuroSDK() {
-        if(isConnected) {
-            disconnect();
-        }
+        // Even when not connected: a receive thread may be part way through reconnecting.
+        // Does nothing if disconnect() was already called.
+        disconnect();
+        joinLoopThread();
+        // Handlers still running on the pool use us, results and all
+        waitForHandlers();
+        cancelAllForces();
     }   
 
     // Connect to the server. Return false if we can't connect.
     bool NeuroSDK::connect(const std::string& url) {
-        if (!ws.connect(url)) {
+        serverUrl = url;
+        if (!openConnection()) {
+            return false;
+        }
+        return startConnection();
+    }
+
+    // Connect and bring the game up in one go: startup, one actions/register for all of the initial
+    // actions and the first context go out together as soon as the upgrade is through
+    bool NeuroSDK::connectAndStart(const std::string& url, const std::vector<Action*> &initialActions, const std::string &initialContext, bool silent) {
+        // All or nothing, so the caller never has to work out which actions it still owns
+        std::vector<Action*> added;
+        registeredActions.add(initialActions, &added);
+        if (added.size() != initialActions.size()) {
+            registeredActions.take(added);
+            std::cerr << "An initial action's name is already registered (or listed twice)." << std::endl;
+            return false;
+        }
+
+        serverUrl = url;
+        if (!openConnection()) {
+            registeredActions.take(added);
+            return false;
+        }
+
+        std::vector<std::string> messages;
+        messages.push_back(encode({ {"command", "startup"}, {"game", gameName} }));
+        if (!added.empty()) {
+            messages.push_back(encode(registerCommand(added)));
+        }
+        if (!initialContext.empty()) {
+            messages.push_back(encode(contextCommand(initialContext, silent)));
+        }
+        if (!ws.send_batch(messages, wireOpcode())) {
+            ws.close();
+            registeredActions.take(added);  // Still the caller's, nothing was registered
+            return false;
+        }
+        startupSent = true;
+        for (Action* action : added) {
+            action->onRegister();
+        }
+        if (!startConnection()) {
+            // Nothing was received, so nothing can have run them
+            for (Action* action : added) {
+                action->onUnregister();
+            }
+            registeredActions.take(added);
             return false;
         }
+        return true;
+    }
+
+    // Start receiving (and writing) on a freshly opened connection
+    bool NeuroSDK::startConnection() {
+        if (options.useWriterThread) {
+            outbound.reopen();
+            // An event loop drains the queue itself
+            if (!writesOnLoop() && !writerThread) {
+                writerThread = new std::thread(&NeuroSDK::writerLoop, this);
+            }
+        }
+
         isConnected = true;
+        stop = false;
+
+        if (options.useEventLoop) {
+            joinLoopThread();  // From a previous connection that was stopped from inside the loop
+#ifdef __linux__
+            if (!startEventLoop()) {
+                ws.close();
+                isConnected = false;
+                return false;
+            }
+            return true;
+#else
+            std::cerr << "Event loop mode is only supported on Linux, using a receive thread." << std::endl;
+#endif
+        }
 
         receiveThread = new std::thread(&NeuroSDK::receiveLoop, this);
-        receiveThread->detach();
+
+        if (options.pingInterval.count() > 0) {
+            keepaliveThread = new std::thread(&NeuroSDK::keepaliveLoop, this);
+        }
 
         return true;
     }
@@ -55,42 +158,90 @@ namespace neuro{
             {"command", "startup"},
             {"game", gameName}
         };
+        startupSent = true;
         return sendCommand(initMessage);
     }
 
     bool NeuroSDK::sendContext(std::string contextMessage, bool silent){
-        json contextMessageJson = {
-            {"command", "context"},
-            {"game", gameName},
-            {"data",{
-                        {"message", contextMessage},
-                        {"silent", silent}
-                } }
-        };
-        return sendCommand(contextMessageJson);   
+        return sendCommand(contextCommand(contextMessage, silent));
     }
 
     bool NeuroSDK::registerAction(Action *action) {
-        registeredActions.push_back(action);
+        if (!addAction(action)) {
+            return false;
+        }
+        if (holdForBatch({ action })) {
+            return true;
+        }
+        return announceActions({ action });
+    }
 
-        // We need these as an array for the server to process.
-        std::vector< json > actionArray;
-        actionArray.push_back(action->toJSON());
-
-        json contextMessageJson = {
-                { "command", "actions/register" },
-                {"game", gameName},
-                {"data", {{
-                    "actions", actionArray,
-                }}}
-            };
+    bool NeuroSDK::registerActions(const std::vector<Action*> &actions) {
+        std::vector<Action*> added;
+        registeredActions.add(actions, &added);
+        if (added.size() < actions.size()) {
+            std::cerr << (actions.size() - added.size()) << " of the actions were already registered." << std::endl;
+        }
+        if (added.empty()) {
+            return false;
+        }
+        if (holdForBatch(added)) {
+            return true;
+        }
+        return announceActions(added);
+    }
+
+    // With a RegistrationBatch open, keep freshly added actions to announce when it ends
+    bool NeuroSDK::holdForBatch(const std::vector<Action*> &actions) {
+        std::lock_guard<std::mutex> lock(batchMutex);
+        if (batchDepth == 0) return false;
+        batchedActions.insert(batchedActions.end(), actions.begin(), actions.end());
+        return true;
+    }
+
+    bool NeuroSDK::registerActions(Action *const *actions, size_t count) {
+        return registerActions(std::vector<Action*>(actions, actions + count));
+    }
+
+    bool NeuroSDK::announceActions(const std::vector<Action*> &actions) {
+        json contextMessageJson = registerCommand(actions);
         if( sendCommand(contextMessageJson) ) {
-            action->onRegister();
+            for (Action *action : actions) {
+                action->onRegister();
+            }
             return true; 
         }
         return false;  // Return false if the command failed to send.
     }
 
+    NeuroSDK::RegistrationBatch::RegistrationBatch(NeuroSDK &sdk) : sdk(sdk) {
+        std::lock_guard<std::mutex> lock(sdk.batchMutex);
+        sdk.batchDepth++;
+    }
+
+    NeuroSDK::RegistrationBatch::~RegistrationBatch() {
+        // Entered before we look, so nothing still registered when we do can be freed under us
+        ActionRegistry::ReadGuard guard(sdk.registeredActions);
+        std::vector<Action*> actions;
+        {
+            std::lock_guard<std::mutex> lock(sdk.batchMutex);
+            if (--sdk.batchDepth > 0) return;
+            actions.swap(sdk.batchedActions);
+        }
+        if (actions.empty()) return;
+
+        // One unregistered on another thread just as we took the list may already be gone.
+        // Compare pointers only, a freed action can't be read.
+        std::vector<Action*> current = sdk.registeredActions.list();
+        std::sort(current.begin(), current.end());
+        actions.erase(std::remove_if(actions.begin(), actions.end(), [&current](Action *action) {
+            return !std::binary_search(current.begin(), current.end(), action);
+        }), actions.end());
+        if (!actions.empty()) {
+            sdk.announceActions(actions);
+        }
+    }
+
     void NeuroSDK::unregisterActions( std::vector< std::string > actions ) {
         json messageJson = {
             { "command", "actions/unregister" },
@@ -98,10 +249,16 @@ namespace neuro{
             { "data", {{"action_names", actions } }},
         };
         sendCommand(messageJson);
-        // Remove the actions from the local list of registered actions
-        for(const std::string actionName : actions) {
-            removeAction(Action(actionName,""));
-        }
+        // Remove the actions from the local list of registered actions.  They are only deleted
+        // once no incoming action can still be running them.
+        registeredActions.remove(actions, [this](Action *action) {
+            {
+                // Registered inside a batch that hasn't been sent yet, so it mustn't be sent now
+                std::lock_guard<std::mutex> lock(batchMutex);
+                batchedActions.erase(std::remove(batchedActions.begin(), batchedActions.end(), action), batchedActions.end());
+            }
+            action->onUnregister(); // Call the onUnregister method before deleting the action object.
+        });
     }
 
     void NeuroSDK::unregisterAction(std::string actionName) {
@@ -113,14 +270,18 @@ namespace neuro{
     void NeuroSDK::unregisterAllActions() {
         std::vector< std::string > actionArray;
 
-        for(const Action* action : registeredActions) {
+        for(const Action* action : registeredActions.list()) {
             actionArray.push_back(action->name);
         }
         unregisterActions(actionArray);
     }
 
     bool NeuroSDK::forceAction( std::string gameState, std::string whatToDo, std::vector<std::string> listOfActions ) {
-        json messageJson = {
+        return sendCommand(forceCommand(std::move(gameState), std::move(whatToDo), std::move(listOfActions)));  // Send the command to force an action and return the result of the operation
+    }
+
+    json NeuroSDK::forceCommand(std::string gameState, std::string whatToDo, std::vector<std::string> listOfActions) {
+        return {
             { "command", "actions/force" },
             { "game", gameName },
             { "data",  {
@@ -131,8 +292,6 @@ namespace neuro{
             }
             }
         };
-
-        return sendCommand(messageJson);  // Send the command to force an action and return the result of the operation
     }
 
 
@@ -140,23 +299,43 @@ namespace neuro{
     // Internal functions
     // ***********************************************************************************
 
-    // Action list management
+    json NeuroSDK::contextCommand(const std::string &contextMessage, bool silent) {
+        return {
+            {"command", "context"},
+            {"game", gameName},
+            {"data",{
+                        {"message", contextMessage},
+                        {"silent", silent}
+                } }
+        };
+    }
 
-    // Remove an action 
-    bool NeuroSDK::removeAction( const Action &action )
-    {
-        // Walk the registeredActions list and remove the specified action (if exists)
-        for(auto it = registeredActions.begin(); it != registeredActions.end(); ++it) {
-            if((*it)->name == action.name) {
-                // delete the action object; then remove it from the list
-                (*it)->onUnregister(); // Call the onUnregister method before deleting the action object.
-                registeredActions.erase(it);
-                delete *it;
-                return true; // Action removed successfully
-            }
+    json NeuroSDK::registerCommand(const std::vector<Action*> &actions) {
+        // We need these as an array for the server to process.
+        std::vector< json > actionArray;
+        for(Action* action : actions) {
+            actionArray.push_back(action->toJSON());
         }
 
-        return false;
+        return {
+            { "command", "actions/register" },
+            {"game", gameName},
+            {"data", {{
+                "actions", actionArray,
+            }}}
+        };
+    }
+
+    // Action list management
+
+    bool NeuroSDK::addAction(Action *action) {
+        std::vector<Action*> added;
+        registeredActions.add({ action }, &added);
+        if (added.empty()) {
+            std::cerr << "An action called " << action->name << " is already registered." << std::endl;
+            return false;
+        }
+        return true;
     }
 
     // Basic RAW send function, will be replaced with task specific ones
@@ -168,83 +347,924 @@ namespace neuro{
         return ws.send(message);
     }
 
+    std::string NeuroSDK::encode(const json &command) const {
+        std::string encoded;
+        switch (wire.load()) {
+        case WireFormat::MessagePack:
+            json::to_msgpack(command, encoded);
+            return encoded;
+        case WireFormat::Cbor:
+            json::to_cbor(command, encoded);
+            return encoded;
+        default:
+            return command.dump();
+        }
+    }
+
+    // Text frames are always JSON, binary ones are in whatever format was negotiated
+    json NeuroSDK::decode(std::string_view message, WebSocket::Opcode opcode) const {
+        if (opcode == WebSocket::Opcode::BINARY) {
+            if (wire == WireFormat::MessagePack) return json::from_msgpack(message.begin(), message.end());
+            if (wire == WireFormat::Cbor) return json::from_cbor(message.begin(), message.end());
+        }
+        return json::parse(message.begin(), message.end());
+    }
+
+    WebSocket::Opcode NeuroSDK::wireOpcode() const {
+        return wire == WireFormat::Json ? WebSocket::Opcode::TEXT : WebSocket::Opcode::BINARY;
+    }
+
+    // Sort a command by its name so the writer and the reconnect logic know what they are holding
+    static CommandKind commandKind(const json &command) {
+        const std::string &name = command["command"].get_ref<const std::string&>();
+        if (name == "context") {
+            const json &data = command["data"];
+            auto silent = data.find("silent");
+            return silent != data.end() && *silent == true ? CommandKind::SilentContext : CommandKind::Context;
+        }
+        if (name == "action/result") return CommandKind::Result;
+        if (name == "actions/force") return CommandKind::Force;
+        if (name == "actions/register") return CommandKind::Register;
+        if (name == "actions/unregister") return CommandKind::Unregister;
+        if (name == "startup") return CommandKind::Startup;
+        return CommandKind::Other;
+    }
+
     bool NeuroSDK::sendCommand(const json &command) {
         try {
-            std::string cmdStr = command.dump();
-            std::cout << cmdStr << std::endl;
-            ws.send(cmdStr);
-            return true;
+            return sendCommand(command, commandKind(command));
         } catch (const std::exception& e) {
             std::cerr << "Error sending command: " << e.what() << std::endl;
             return false;
         }
     }
 
-    bool NeuroSDK::receive(std::string* output) {
+    bool NeuroSDK::sendCommand(const json &command, CommandKind kind) {
+        try {
+            std::string cmdStr = encode(command);
+            if (options.logTraffic && wire == WireFormat::Json) {
+                std::cout << cmdStr << std::endl;
+            }
+            std::string text;
+            if (kind == CommandKind::SilentContext && options.contextOverflow == OverflowPolicy::Merge) {
+                text = command["data"]["message"].get<std::string>();
+            }
+            OutboundCommand outboundCommand{ kind, std::move(cmdStr), std::move(text) };
+            if (!isConnected || !options.useWriterThread) {
+                return sendOrHold(std::move(outboundCommand));
+            }
+            // The writer sends it (or holds it if the link has gone) when it next wakes up
+            if (outbound.push(std::move(outboundCommand))) {
+                if (writesOnLoop()) postFlush();
+                return true;
+            }
+            std::cerr << "Not connected to the server." << std::endl;
+            return false;
+        } catch (const std::exception& e) {
+            std::cerr << "Error sending command: " << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    bool NeuroSDK::receive(WebSocket::Message* output) {
         if(!isConnected) { 
             std::cerr << "Not connected to the server." << std::endl; 
             return false;
         }   
-        ws.receive(output);
-        return output->length() > 0; // Return true if received data is not empty
+        return ws.receive(output);  // False once the connection has gone
     }
 
     void NeuroSDK::disconnect() {
-        if(isConnected) { 
-            ws.close(); 
-            isConnected = false; 
+        // Never connected or already disconnected: nothing to tear down, nothing to report
+        if (!isConnected && !receiveThread && !loop && !writerThread && !keepaliveThread) {
+            return;
         }
-        std::cout << "Disconnected from the server." << std::endl;
+
+        // Let whatever is queued (typically the unregisters) go out before we close
+        stopWriter();
 
         stop = true; // Signal to stop the receive loop
+        stopKeepalive();
+        stopReconnect();
+
+        if(loop) {
+            // The loop owns the socket, so let it close it
+            stopEventLoop();
+        }
+
+        outbound.clear();
 
-        //Stop and clean up the receive thread
-        if(receiveThread && receiveThread->joinable()) {
-            receiveThread->join();
+        //Stop and clean up the receive thread, shutting the socket down knocks it out of recv()
+        if(receiveThread) {
+            ws.interrupt();
+            if(receiveThread->get_id() == std::this_thread::get_id()) {
+                receiveThread->detach();  // Called from an action handler, we can't join ourselves
+            } else if(receiveThread->joinable()) {
+                receiveThread->join();
+            }
             delete receiveThread;
             receiveThread = nullptr;
         }
+
+        if(isConnected) { 
+            ws.close(); 
+            isConnected = false; 
+        }
+        {
+            std::lock_guard<std::mutex> lock(heldMutex);
+            heldCommands.clear();
+        }
+        // Whatever was forced is gone with the connection (or never left), no answer is coming
+        cancelAllForces();
+        std::cout << "Disconnected from the server." << std::endl;
     }   
 
     void NeuroSDK::receiveLoop() {
-        std::string output;
+        WebSocket::Message output;
         while (!stop) {
-            receive(&output);
-            if(!output.empty()) {
-                std::cout << output << std::endl; // Process the received data
-
-                bool success = false;
-                json j = json::parse(output);
-                if(j["command"] == "action") {
-                    // Extract action name from JSON data
-                    std::string actionName = j["data"]["name"];
-                    std::string actionMessage = "Something happened";
-
-                    // Walk registered actions to find a match
-                    for(auto action : registeredActions) {
-                        if(action->name == actionName) {
-                            // Handle the action
-                            auto result = action->onAction(j["data"]);
-                            success = std::get<0>(result); // Extract the success status from the tuple
-                            actionMessage = std::get<1>(result); // Extract the message from the tuple
-                            break;
-                       }
+            if(!receive(&output)) {
+                if(stop) break;
+                std::cerr << "Connection to the server lost." << std::endl;
+                isConnected = false;
+                ws.close();
+                if(options.autoReconnect && reconnect()) {
+                    continue;
+                }
+                break;
+            }
+            if(!output.payload.empty()) {
+                try {
+                    handleMessage(output.payload, output.opcode);
+                } catch (const std::exception& e) {
+                    std::cerr << "Error handling message: " << e.what() << std::endl;
+                }
+            }
+        }
+    }
+
+    // The message points into the socket's buffers, parse it from there rather than copying it
+    void NeuroSDK::handleMessage(std::string_view message, WebSocket::Opcode opcode) {
+        if (options.logTraffic && opcode == WebSocket::Opcode::TEXT) {
+            std::cout << message << std::endl;
+        }
+
+        json j = decode(message, opcode);
+        if(j["command"] == "action") {
+            if (forcesWaiting > 0 && claimForce(j["data"])) {
+                return;  // Answered a force someone is awaiting
+            }
+            if (options.dispatchOnPoll) {
+                // The game runs it next time it polls
+                polledActions.push(std::move(j["data"]));
+                return;
+            }
+            if (handlers) {
+                // Off to the pool, we carry on receiving while it runs
+                dispatchToPool(std::move(j["data"]));
+                return;
+            }
+            // Send the response back to the Neuro
+            sendCommand(runAction(j["data"]));
+        }               
+    }
+
+    // Results go through sendCommand(), so with the writer thread on this never waits on the socket
+    size_t NeuroSDK::poll(size_t maxItems, std::chrono::microseconds timeBudget) {
+        auto deadline = std::chrono::steady_clock::now() + timeBudget;
+        size_t ran = 0;
+        json data;
+        while (ran < maxItems && polledActions.pop(data)) {
+            try {
+                sendCommand(runAction(data));
+            } catch (const std::exception& e) {
+                std::cerr << "Error handling action: " << e.what() << std::endl;
+            }
+            ran++;
+            if (timeBudget.count() > 0 && std::chrono::steady_clock::now() >= deadline) {
+                break;
+            }
+        }
+        return ran;
+    }
+
+    // Throws for an action without an id, there is nothing to answer it with
+    json NeuroSDK::runAction(const json &data) {
+        // data is const, so only find(): a missing key through operator[] is undefined, not an error
+        auto id = data.find("id");
+        if (id == data.end()) {
+            throw std::invalid_argument("Action without an id");
+        }
+        auto name = data.find("name");
+        if (name == data.end() || !name->is_string()) {
+            return resultCommand(*id, false, "Action without a name");
+        }
+        bool success = false;
+        const std::string &actionName = name->get_ref<const std::string&>();
+        std::string actionMessage = "Something happened";
+
+        // Look the action up by name.  The guard keeps it alive while it runs, even if it
+        // (or the game thread) unregisters it meanwhile.
+        ActionRegistry::ReadGuard guard(registeredActions);
+        if(Action *action = registeredActions.find(actionName)) {
+            // Handle the action
+            try {
+                auto result = action->onAction(data);
+                success = std::get<0>(result); // Extract the success status from the tuple
+                actionMessage = std::get<1>(result); // Extract the message from the tuple
+            } catch (const std::exception& e) {
+                actionMessage = e.what();  // Neuro still gets an answer
+            }
+        }
+
+        return resultCommand(*id, success, actionMessage);
+    }
+
+    json NeuroSDK::resultCommand(const json &id, bool success, const std::string &message) {
+        return {
+            {"command", "action/result"},
+            {"game", gameName},
+            {"data", {
+                {"id", id},
+                {"success", success},
+                {"message", message}
+            }
+        } };
+    }
+
+    // ***********************************************************************************
+    // Awaited forces
+    // ***********************************************************************************
+
+    void NeuroSDK::addPendingForce(PendingForce *force) {
+        std::lock_guard<std::mutex> lock(forceMutex);
+        force->next = nullptr;
+        if (lastForce) {
+            lastForce->next = force;
+        } else {
+            firstForce = force;
+        }
+        lastForce = force;
+        forcesWaiting++;
+    }
+
+    // Take a force back out, false if it has already been answered
+    bool NeuroSDK::cancelPendingForce(PendingForce *force) {
+        std::lock_guard<std::mutex> lock(forceMutex);
+        PendingForce *previous = nullptr;
+        for (PendingForce *it = firstForce; it; previous = it, it = it->next) {
+            if (it != force) continue;
+            (previous ? previous->next : firstForce) = it->next;
+            if (lastForce == it) lastForce = previous;
+            forcesWaiting--;
+            return true;
+        }
+        return false;
+    }
+
+    // Hand an incoming action to the oldest force that offered it, false if none did
+    bool NeuroSDK::claimForce(json &data) {
+        PendingForce *claimed = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(forceMutex);
+            const std::string &actionName = data["name"].get_ref<const std::string&>();
+            PendingForce *previous = nullptr;
+            for (PendingForce *it = firstForce; it; previous = it, it = it->next) {
+                if (std::find(it->actions.begin(), it->actions.end(), actionName) == it->actions.end()) continue;
+                (previous ? previous->next : firstForce) = it->next;
+                if (lastForce == it) lastForce = previous;
+                forcesWaiting--;
+                claimed = it;
+                break;
+            }
+        }
+        if (!claimed) return false;
+        // Not under the lock, resuming may run the coroutine right here and it may force again
+        claimed->action = std::move(data);
+        claimed->resume();
+        return true;
+    }
+
+    // Nothing will answer the forces still waiting, let their coroutines finish with an empty result
+    void NeuroSDK::cancelAllForces() {
+        PendingForce *force;
+        {
+            std::lock_guard<std::mutex> lock(forceMutex);
+            force = firstForce;
+            firstForce = lastForce = nullptr;
+            forcesWaiting = 0;
+        }
+        while (force) {
+            PendingForce *next = force->next;  // Read first, resuming may free it
+            force->action = nullptr;
+            force->resume();
+            force = next;
+        }
+    }
+
+    // The action is looked up when the handler runs, not now, so it may be unregistered meanwhile
+    void NeuroSDK::dispatchToPool(json data) {
+        std::string key = gameName;
+        if (options.handlerOrdering == HandlerOrdering::PerAction) {
+            key += '/';
+            key += data["name"].get_ref<const std::string&>();
+        }
+        {
+            std::lock_guard<std::mutex> lock(handlersMutex);
+            handlersInFlight++;
+        }
+        handlers->post(key, [this, data = std::move(data)]() {
+            try {
+                sendCommand(runAction(data));
+            } catch (const std::exception& e) {
+                std::cerr << "Error handling action: " << e.what() << std::endl;
+            }
+            std::lock_guard<std::mutex> lock(handlersMutex);
+            if (--handlersInFlight == 0) handlersDone.notify_all();
+        });
+    }
+
+    void NeuroSDK::waitForHandlers() {
+        std::unique_lock<std::mutex> lock(handlersMutex);
+        handlersDone.wait(lock, [this]() { return handlersInFlight == 0; });
+    }
+
+    // ***********************************************************************************
+    // Reconnecting
+    // ***********************************************************************************
+
+    bool NeuroSDK::openConnection() {
+        ws.set_max_message_size(options.maxMessageSize);
+        ws.set_fragment_size(options.fragmentSize);
+        ws.set_deflate_options(options.compression);
+        ws.set_connect_timeout(options.connectTimeout);
+        ws.set_socket_options(options.socketOptions);
+        ws.set_peer_check(options.peerCheck);
+        if (!ws.set_io_uring(options.useIoUring)) {
+            std::cerr << "Built without io_uring support, using the socket directly." << std::endl;
+        }
+        switch (options.wireFormat) {
+        case WireFormat::MessagePack: ws.set_subprotocols({ "neuro-msgpack" }); break;
+        case WireFormat::Cbor: ws.set_subprotocols({ "neuro-cbor" }); break;
+        default: ws.set_subprotocols({}); break;
+        }
+        if (!ws.connect(serverUrl)) {
+            return false;
+        }
+        const std::string &chosen = ws.selected_subprotocol();
+        wire = chosen == "neuro-msgpack" ? WireFormat::MessagePack : chosen == "neuro-cbor" ? WireFormat::Cbor : WireFormat::Json;
+        return true;
+    }
+
+    // Keep trying to get the connection back, with exponential backoff.
+    // Returns false if disconnect() was called before we managed it.
+    bool NeuroSDK::reconnect() {
+        std::mt19937 random(std::random_device{}());
+        std::chrono::milliseconds delay = options.reconnectDelay;
+        while (!stop) {
+            // Wait somewhere between half and all of the current delay
+            std::uniform_int_distribution<long long> jitter(delay.count() / 2, delay.count());
+            {
+                std::unique_lock<std::mutex> lock(reconnectMutex);
+                reconnectWake.wait_for(lock, std::chrono::milliseconds(jitter(random)), [this]() { return stop.load(); });
+            }
+            if (stop) break;
+
+            std::cerr << "Reconnecting to the server..." << std::endl;
+            if (openConnection()) {
+                if (replayState()) {
+                    std::cerr << "Reconnected to the server." << std::endl;
+                    return true;
+                }
+                ws.close();
+            }
+            delay = (std::min)(delay * 2, options.maxReconnectDelay);
+        }
+        return false;
+    }
+
+    // Bring a fresh connection back up to where the old one was, then let held commands out
+    bool NeuroSDK::replayState() {
+        // Held throughout, so the writer and direct sends (which check isConnected under it) wait
+        // until startup and the actions are back before anything of theirs goes out
+        std::lock_guard<std::mutex> lock(heldMutex);
+        if (startupSent) {
+            json initMessage = {
+                {"command", "startup"},
+                {"game", gameName}
+            };
+            if (!ws.send(encode(initMessage), wireOpcode())) return false;
+        }
+        if (!registeredActions.empty()) {
+            if (!ws.send(encode(registerCommand(registeredActions.list())), wireOpcode())) return false;
+        }
+
+        // Flip isConnected under the lock so nothing can be held after we've flushed
+        std::vector<OutboundCommand> held;
+        heldCommands.takeAll(held);
+        for (size_t i = 0; i < held.size(); i++) {
+            if (held[i].message.empty()) {
+                held[i].message = encode(contextCommand(held[i].text, true));  // Merged
+            }
+            if (!ws.send(held[i].message, wireOpcode())) {
+                // Keep the rest for the next attempt
+                for (; i < held.size(); i++) {
+                    heldCommands.push(std::move(held[i]));
+                }
+                return false;
+            }
+        }
+        isConnected = true;
+        return true;
+    }
+
+    // Hold on to a command while the connection is down, returns false if we aren't reconnecting
+    // Send straight away if connected, otherwise (or if the send fails) keep it for after the reconnect
+    bool NeuroSDK::sendOrHold(OutboundCommand command) {
+        std::lock_guard<std::mutex> lock(heldMutex);
+        if (isConnected && ws.send(command.message, wireOpcode())) {
+            return true;
+        }
+        return holdLocked(std::move(command));
+    }
+
+    // heldMutex must be held
+    // heldMutex must be held.  Past maxHeldCommands the same things give way as in the writer's
+    // queue: silent contexts (dropped or merged) and older forces, never results.
+    bool NeuroSDK::holdLocked(OutboundCommand command) {
+        if (!options.autoReconnect || stop) {
+            std::cerr << "Not connected to the server." << std::endl;
+            return false;
+        }
+        // The replay re-registers whatever is registered by then
+        if (command.kind == CommandKind::Register || command.kind == CommandKind::Unregister) {
+            return true;
+        }
+        heldCommands.push(std::move(command));
+        return true;
+    }
+
+    // Wake a receive thread out of its backoff (the event loop cancels its own reconnect when we leave it)
+    void NeuroSDK::stopReconnect() {
+        std::lock_guard<std::mutex> lock(reconnectMutex);
+        reconnectWake.notify_all();
+    }
+
+    // ***********************************************************************************
+    // Writer thread
+    // ***********************************************************************************
+
+    // Take everything queued since the last pass and send it with one write
+    void NeuroSDK::writerLoop() {
+        std::vector<OutboundCommand> batch;
+        std::vector<std::string> messages;
+        while (outbound.popAll(batch)) {
+            messages.clear();
+            for (OutboundCommand &command : batch) {
+                if (command.message.empty()) {
+                    command.message = encode(contextCommand(command.text, true));  // Merged
+                }
+                messages.push_back(std::move(command.message));
+            }
+            {
+                // Nothing goes out while a reconnect hasn't finished its replay, it is held for it
+                std::lock_guard<std::mutex> lock(heldMutex);
+                if (!isConnected || !ws.send_batch(messages, wireOpcode())) {
+                    // The link has probably just died, keep them for after the reconnect
+                    for (size_t i = 0; i < batch.size(); i++) {
+                        batch[i].message = std::move(messages[i]);
+                        holdLocked(std::move(batch[i]));
+                    }
+                }
+            }
+            batch.clear();
+        }
+    }
+
+    // Stop taking commands and wait for the writer to send what is left.  On an event loop the
+    // last of the queue is written as the socket comes off the loop.
+    void NeuroSDK::stopWriter() {
+        outbound.close();
+        if (!writerThread) return;
+        writerThread->join();
+        delete writerThread;
+        writerThread = nullptr;
+    }
+
+    // ***********************************************************************************
+    // Keepalive
+    // ***********************************************************************************
+
+    bool NeuroSDK::keepalive() {
+        if (ws.idle_time() > options.pingTimeout) {
+            std::cerr << "No response from the server, dropping the connection." << std::endl;
+            return false;
+        }
+        ws.send_ping();
+        return true;
+    }
+
+    // Keep "no sample yet" negative rather than letting it round to zero
+    static std::chrono::microseconds toMicroseconds(std::chrono::nanoseconds time) {
+        if (time.count() < 0) return std::chrono::microseconds(-1);
+        return std::chrono::duration_cast<std::chrono::microseconds>(time);
+    }
+
+    std::chrono::microseconds NeuroSDK::smoothedRTT() const { return toMicroseconds(ws.smoothed_round_trip()); }
+    std::chrono::microseconds NeuroSDK::lastRTT() const { return toMicroseconds(ws.last_round_trip()); }
+    std::chrono::microseconds NeuroSDK::rttJitter() const { return toMicroseconds(ws.round_trip_jitter()); }
+
+    void NeuroSDK::keepaliveLoop() {
+        std::unique_lock<std::mutex> lock(keepaliveMutex);
+        while (!stop) {
+            keepaliveWake.wait_for(lock, options.pingInterval);
+            if (stop) break;
+            if (!isConnected) continue;  // Down, and maybe reconnecting
+            if (!keepalive()) {
+                // Knock the receive thread out of recv(), it reports the lost connection
+                ws.interrupt();
+            }
+        }
+    }
+
+    void NeuroSDK::stopKeepalive() {
+        if (!keepaliveThread) return;
+        {
+            std::lock_guard<std::mutex> lock(keepaliveMutex);
+            keepaliveWake.notify_all();
+        }
+        keepaliveThread->join();
+        delete keepaliveThread;
+        keepaliveThread = nullptr;
+    }
+
+    // ***********************************************************************************
+    // Event loop mode
+    // ***********************************************************************************
+
+#ifdef __linux__
+    // Hand the socket over to the event loop, creating (and running) our own loop if we weren't given one
+    bool NeuroSDK::startEventLoop() {
+        ws.set_on_message_view([this](const WebSocket::Message &message) {
+            try {
+                handleMessage(message.payload, message.opcode);
+            } catch (const std::exception& e) {
+                std::cerr << "Error handling message: " << e.what() << std::endl;
+            }
+        });
+
+        EventLoop *target = options.eventLoop;
+        if (!target) {
+            ownLoop.reset(new EventLoop());
+            target = ownLoop.get();
+        }
+        loop = target;
+
+        target->post([this]() { attachToLoop(); });
+
+        if (ownLoop) {
+            loopThread = new std::thread([target]() { target->run(); });
+        }
+        return true;
+    }
+
+    // Start watching the (freshly connected) socket, loop thread only
+    void NeuroSDK::attachToLoop() {
+        if (stop) {
+            ws.close();
+            isConnected = false;
+            return;
+        }
+        EventLoop *current = loop;
+        int fd = ws.event_handle();
+        if (!ws.set_nonblocking(true) || !current->add(fd, EPOLLIN | EPOLLRDHUP, [this](uint32_t events) { onSocketEvent(events); })) {
+            std::cerr << "Failed to add the socket to the event loop." << std::endl;
+            ws.close();
+            isConnected = false;
+            connectionLost();
+            return;
+        }
+        attached = true;
+        // Frames that came in with the upgrade response are already buffered and epoll won't report
+        // them, so handle them now.  With io_uring this also arms the receive, whose completions go
+        // to the thread that armed it.
+        if (!ws.on_readable()) {
+            dropFromLoop();
+            return;
+        }
+        if (!attached) return;  // A handler disconnected us
+        if (options.pingInterval.count() > 0) {
+            pingTimer = current->addTimer(options.pingInterval, [this]() {
+                if (!keepalive()) {
+                    dropFromLoop();
+                } else {
+                    watchWritable(ws.pending_bytes() > 0);
+                }
+            }, options.pingInterval);
+        }
+        // Whatever was queued while we were connecting, reconnecting or moving
+        flushOutbound();
+    }
+
+    // Take the socket back off the loop; once this returns the loop will not touch us again
+    void NeuroSDK::stopEventLoop() {
+        EventLoop *current = loop;
+        auto detach = [this]() {
+            cancelReconnect();
+            if (attached) unwatch();  // The socket stays open for the last of the queue
+        };
+
+        if (current->isInLoopThread()) {
+            // disconnect() was called from inside one of our callbacks
+            detach();
+            if (ownLoop) {
+                // We can't join ourselves, the destructor picks the thread up
+                current->stop();
+            }
+        } else if (ownLoop) {
+            // Nobody else uses our own loop, so stop it and then tidy up from this thread
+            current->stop();
+            joinLoopThread();
+            detach();
+            ownLoop.reset();
+        } else {
+            std::promise<void> done;
+            std::future<void> finished = done.get_future();
+            current->post([&detach, &done]() {
+                detach();
+                done.set_value();
+            });
+            finished.wait();
+        }
+        loop = nullptr;
+
+        // Off the loop now: let whatever is queued (typically the unregisters) go out, waiting on the
+        // socket as the writer thread would, then close
+        if (isConnected) {
+            std::vector<OutboundCommand> batch;
+            std::vector<std::string> messages;
+            outbound.takeAll(batch);
+            for (OutboundCommand &command : batch) {
+                if (command.message.empty()) {
+                    command.message = encode(contextCommand(command.text, true));  // Merged
+                }
+                messages.push_back(std::move(command.message));
+            }
+            if (!messages.empty()) ws.send_batch(messages, wireOpcode());
+            ws.flush_pending(true);
+        }
+        ws.close();
+        isConnected = false;
+    }
+
+    void NeuroSDK::joinLoopThread() {
+        if (!loopThread) return;
+        if (loopThread->get_id() == std::this_thread::get_id()) {
+            loopThread->detach();
+        } else if (loopThread->joinable()) {
+            loopThread->join();
+        }
+        delete loopThread;
+        loopThread = nullptr;
+    }
+
+    void NeuroSDK::onSocketEvent(uint32_t events) {
+        bool alive = true;
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            alive = ws.on_readable();
+        }
+        if (!attached) return;  // A handler disconnected us
+        if (alive && (events & EPOLLOUT)) {
+            alive = ws.flush_pending();
+        }
+        if (!alive || (events & (EPOLLHUP | EPOLLERR))) {
+            std::cerr << "Connection to the server lost." << std::endl;
+            dropFromLoop();
+            return;
+        }
+        // Results the handlers have just queued, or the next batch now that the socket has drained
+        flushOutbound();
+    }
+
+    bool NeuroSDK::moveToLoop(EventLoop *target) {
+        EventLoop *current = loop;
+        if (!current || !target || ownLoop) return false;
+        if (target == current) return true;
+
+        // Runs on the old loop, after which it never touches us again.  Commands still queued go out
+        // from the new loop, flushes posted to the old one are passed on to it.
+        auto move = [this, target]() {
+            if (!isConnected || stop || !attached || ws.uring_active()) return false;
+            unwatch();
+            loop = target;
+            options.eventLoop = target;
+            target->post([this]() { attachToLoop(); });
+            return true;
+        };
+
+        if (current->isInLoopThread()) {
+            // The rest of the current read still has to finish on this thread
+            current->post([move]() { move(); });
+            return true;
+        }
+        std::promise<bool> done;
+        std::future<bool> moved = done.get_future();
+        current->post([&move, &done]() { done.set_value(move()); });
+        return moved.get();
+    }
+
+    // Take the socket off the loop and close it (loop thread only), then reconnect if we should
+    void NeuroSDK::dropFromLoop() {
+        if (!attached) return;  // Already off, a handler may have disconnected us
+        unwatch();
+        ws.close();
+        isConnected = false;
+        connectionLost();
+    }
+
+    // Stop watching the socket and cancel its ping timer (loop thread only)
+    void NeuroSDK::unwatch() {
+        EventLoop *current = loop;
+        if (pingTimer) {
+            current->cancelTimer(pingTimer);
+            pingTimer = 0;
+        }
+        if (watchingWritable && ws.native_handle() != ws.event_handle()) {
+            current->remove(ws.native_handle());
+        }
+        watchingWritable = false;
+        current->remove(ws.event_handle());
+        attached = false;
+    }
+
+    // ***********************************************************************************
+    // Writing from the loop
+    // ***********************************************************************************
+
+    // With useWriterThread the loop is the writer, no thread of its own needed
+    bool NeuroSDK::writesOnLoop() const {
+        return options.useEventLoop && options.useWriterThread;
+    }
+
+    // Wake the loop to write what was just queued.  One flush covers everything pushed before it
+    // runs, so a burst of commands costs a single wakeup.
+    void NeuroSDK::postFlush() {
+        if (flushPosted.exchange(true)) return;
+        EventLoop *current = loop;
+        if (current) {
+            current->post([this]() { flushOutbound(); });
+        } else {
+            flushPosted = false;  // Not on a loop yet, attachToLoop() flushes
+        }
+    }
+
+    // Runs a posted flush on whichever loop we are on now, we may have moved since it was posted
+    void NeuroSDK::flushOutbound() {
+        EventLoop *current = loop;
+        if (!current) return;
+        if (!current->isInLoopThread()) {
+            current->post([this]() { flushOutbound(); });
+            return;
+        }
+        flushPosted = false;
+        writeQueued();
+    }
+
+    // Write everything queued in one go, without waiting on the socket (loop thread only).  Nothing
+    // more is taken while bytes from the last batch are still pending, so a stalled peer leaves
+    // commands in the bounded queue to be dropped or merged; EPOLLOUT brings us back once it drains.
+    void NeuroSDK::writeQueued() {
+        bool failed = false;
+        if (!attached || ws.pending_bytes() == 0) {
+            // Nothing goes out while a reconnect hasn't finished its replay, it is held for it
+            std::lock_guard<std::mutex> lock(heldMutex);
+            if (!attached && isConnected) return;  // Back up but not on the loop yet, attachToLoop() flushes
+            std::vector<OutboundCommand> batch;
+            if (outbound.takeAll(batch)) {
+                std::vector<std::string> messages;
+                messages.reserve(batch.size());
+                for (OutboundCommand &command : batch) {
+                    if (command.message.empty()) {
+                        command.message = encode(contextCommand(command.text, true));  // Merged
+                    }
+                    messages.push_back(std::move(command.message));
+                }
+                if (!attached || !ws.queue_batch(messages, wireOpcode())) {
+                    for (size_t i = 0; i < batch.size(); i++) {
+                        batch[i].message = std::move(messages[i]);
+                        holdLocked(std::move(batch[i]));
                     }
-                
-                    // Send a response back to the Neuro
-                    json result = {
-                        {"command", "action/result"},
-                        {"game", gameName},
-                        {"data", {
-                            {"id", j["data"]["id"]},
-                            {"success", success},
-                            {"message", actionMessage}
-                        }
-                    } };
-                    // Send the response back to the Neuro
-                    sendCommand(result);
-                }               
+                    failed = attached;
+                }
             }
         }
+        if (failed) {
+            std::cerr << "Connection to the server lost." << std::endl;
+            dropFromLoop();
+        } else if (attached) {
+            watchWritable(ws.pending_bytes() > 0);
+        }
+    }
+
+    // Watch for EPOLLOUT only while bytes are pending.  With io_uring the loop watches the ring rather
+    // than the socket, so the socket is added on its own for as long as that lasts.
+    void NeuroSDK::watchWritable(bool enable) {
+        if (enable == watchingWritable) return;
+        EventLoop *current = loop;
+        int fd = ws.event_handle();
+        int socket = ws.native_handle();
+        bool changed;
+        if (socket == fd) {
+            uint32_t events = EPOLLIN | EPOLLRDHUP;
+            if (enable) events |= EPOLLOUT;
+            changed = current->modify(fd, events);
+        } else if (enable) {
+            changed = current->add(socket, EPOLLOUT, [this](uint32_t events) { onSocketEvent(events); });
+        } else {
+            current->remove(socket);
+            changed = true;
+        }
+        if (changed) watchingWritable = enable;
+    }
+
+    // ***********************************************************************************
+    // Reconnecting from the loop
+    // ***********************************************************************************
+
+    // The loop waits out the backoff on a timer rather than a thread sleeping through it
+    void NeuroSDK::connectionLost() {
+        if (stop || !options.autoReconnect) return;
+        reconnectBackoff = options.reconnectDelay;
+        scheduleReconnect();
+    }
+
+    // Somewhere between half and all of the current delay, so a room full of games spreads out
+    void NeuroSDK::scheduleReconnect() {
+        std::mt19937 random(std::random_device{}());
+        std::uniform_int_distribution<long long> jitter(reconnectBackoff.count() / 2, reconnectBackoff.count());
+        reconnectTimer = loop.load()->addTimer(std::chrono::milliseconds(jitter(random)), [this]() {
+            reconnectTimer = 0;
+            startReconnectAttempt();
+        });
+    }
+
+    // connect() blocks for up to connectTimeout, which would hold up every session on the loop, so an
+    // attempt gets a thread for as long as it lasts and hands the result back to the loop
+    void NeuroSDK::startReconnectAttempt() {
+        if (stop) return;
+        EventLoop *current = loop;
+        std::shared_ptr<ReconnectAttempt> attempt = std::make_shared<ReconnectAttempt>();
+        reconnectAttempt = attempt;
+        attempt->thread = std::thread([this, current, attempt]() {
+            std::cerr << "Reconnecting to the server..." << std::endl;
+            bool reconnected = openConnection();
+            if (reconnected && !replayState()) {
+                ws.close();
+                reconnected = false;
+            }
+            current->post([this, attempt, reconnected]() {
+                if (attempt->cancelled) return;  // cancelReconnect() already joined it, we may be gone
+                attempt->thread.join();
+                reconnectAttempt.reset();
+                if (reconnected) {
+                    std::cerr << "Reconnected to the server." << std::endl;
+                    attachToLoop();
+                } else if (!stop) {
+                    reconnectBackoff = (std::min)(reconnectBackoff * 2, options.maxReconnectDelay);
+                    scheduleReconnect();
+                }
+            });
+        });
+    }
+
+    // Called as we leave the loop, waits for an attempt in progress to give up
+    void NeuroSDK::cancelReconnect() {
+        if (reconnectTimer) {
+            loop.load()->cancelTimer(reconnectTimer);
+            reconnectTimer = 0;
+        }
+        if (reconnectAttempt) {
+            reconnectAttempt->cancelled = true;
+            reconnectAttempt->thread.join();
+            reconnectAttempt.reset();
+        }
     }
+#else
+    bool NeuroSDK::startEventLoop() { return false; }
+    void NeuroSDK::connectionLost() {}
+    void NeuroSDK::stopEventLoop() {}
+    void NeuroSDK::joinLoopThread() {}
+    void NeuroSDK::onSocketEvent(uint32_t) {}
+    void NeuroSDK::dropFromLoop() {}
+    void NeuroSDK::attachToLoop() {}
+    bool NeuroSDK::moveToLoop(EventLoop *) { return false; }
+    bool NeuroSDK::writesOnLoop() const { return false; }
+    void NeuroSDK::postFlush() {}
+    void NeuroSDK::flushOutbound() {}
+    void NeuroSDK::writeQueued() {}
+    void NeuroSDK::watchWritable(bool) {}
+    void NeuroSDK::unwatch() {}
+    void NeuroSDK::scheduleReconnect() {}
+    void NeuroSDK::startReconnectAttempt() {}
+    void NeuroSDK::cancelReconnect() {}
+#endif
 }
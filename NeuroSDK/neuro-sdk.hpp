@@ -1,25 +1,149 @@
 #pragma once
 #include "include/simplews.hpp"
 #include "include/nlohmann/json.hpp"
+#include "outbound-queue.h"
+#include "action-registry.h"
+#include "handler-pool.h"
+#include "mpsc-queue.h"
 using json = nlohmann::json;
 #include <thread>
 #include <tuple>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <string_view>
+#include <unordered_map>
 
 namespace neuro{
 
 // Forward def
 class NeuroSDK;
+class EventLoop;
+
+// How commands are encoded on the wire.  Neuro itself only speaks JSON; the binary formats are
+// for a relay of our own that translates, and are offered as a WebSocket subprotocol
+// (neuro-msgpack / neuro-cbor) so anything that doesn't pick one gets plain JSON text frames.
+enum class WireFormat {
+    Json,
+    MessagePack,
+    Cbor
+};
+
+// Which onAction() calls have to wait for each other when they run on a HandlerPool
+enum class HandlerOrdering {
+    PerAction,  // Calls for the same action run one at a time, in the order they came in
+    PerGame     // Every call for this game does (still off the receive thread)
+};
+
+// Options that change how the SDK drives its connection
+struct SDKOptions {
+    // Drive the socket from an epoll event loop instead of a blocking receive thread (Linux only).
+    // The socket is made non-blocking and disconnect() can interrupt the loop at any time.
+    bool useEventLoop = false;
+
+    // A loop to share with other connections.  If this is null and useEventLoop is set the SDK
+    // creates its own loop and runs it on a thread of its own.  A shared loop is run by the caller.
+    EventLoop *eventLoop = nullptr;
+
+    // Give up on a connect (trying every address the name resolves to, then the upgrade) after this long
+    std::chrono::milliseconds connectTimeout{ 10000 };
+
+    // TCP options for the connection (Nagle is off by default), see NeuroSDK/include/wssocket.hpp
+    simplews::SocketOptions socketOptions;
+
+    // For unix:///path servers, who may be listening on the socket (by default our own user or root)
+    simplews::PeerCheck peerCheck;
+
+    // Largest incoming message (after reassembling fragments) we accept before dropping the connection
+    size_t maxMessageSize = 16 * 1024 * 1024;
+
+    // Outgoing messages longer than this are sent as several fragments, 0 never fragments
+    size_t fragmentSize = 0;
+
+    // Ping the server this often to measure the round trip time and spot a dead link (0 turns it off)
+    std::chrono::milliseconds pingInterval{ 0 };
+
+    // With pings on, a connection that has heard nothing back for this long is dropped
+    std::chrono::milliseconds pingTimeout{ 10000 };
+
+    // Reconnect by ourselves when the connection drops.  Once back we replay startup (if gameinit()
+    // had been called) and re-register every action in one message.
+    bool autoReconnect = false;
+
+    // Wait before the first reconnect attempt, doubling after each failure up to maxReconnectDelay.
+    // Each wait is jittered so a room full of games doesn't reconnect in lockstep.  On an event loop
+    // the waits are timers on the loop and only the connect itself takes a (short-lived) thread.
+    std::chrono::milliseconds reconnectDelay{ 250 };
+    std::chrono::milliseconds maxReconnectDelay{ 30000 };
+
+    // Commands sent while reconnecting are held and sent once the link is back.  Past this many the
+    // contextOverflow policy applies as it does to the writer's queue, results are never dropped.
+    // Action (un)registrations aren't held, the replay covers them.
+    size_t maxHeldCommands = 256;
+
+    // permessage-deflate compression, needs the SDK built with SIMPLEWS_WITH_ZLIB (and zlib linked)
+    simplews::DeflateOptions compression;
+
+    // Hand commands to a writer thread instead of writing to the socket on the caller's thread.
+    // sendContext() and friends then return as soon as the command is queued, and everything queued
+    // while the writer was busy goes out in a single write.  With useEventLoop (on Linux) the loop is
+    // the writer: it drains the queue itself, so no thread is added.
+    bool useWriterThread = true;
+
+    // How many commands may wait for the writer while the link is slow (0 for no limit).  A full
+    // queue never blocks the caller: silent contexts are dropped oldest first (or merged, see
+    // contextOverflow), a force still waiting is always replaced by a newer one, and results and
+    // action (un)registrations are kept even past the limit.
+    size_t maxQueuedCommands = 1024;
+    OverflowPolicy contextOverflow = OverflowPolicy::DropOldest;
+
+    // onQueueHighWater is called (on the thread sending the command) when the queue grows past
+    // queueHighWater, then not again until the writer has caught up
+    size_t queueHighWater = 768;
+    std::function<void(size_t queued)> onQueueHighWater;
+
+    // Ask for commands as binary frames in this format, falling back to JSON if the server doesn't agree
+    WireFormat wireFormat = WireFormat::Json;
+
+    // Run onAction() on a pool of handler threads rather than on the thread receiving, so a slow
+    // handler doesn't hold up the messages (and pings) behind it.  The result is sent when the
+    // handler returns.  0 runs handlers inline as they arrive.
+    unsigned handlerThreads = 0;
+
+    // A pool to share with other connections instead of one of our own (used whatever handlerThreads is)
+    HandlerPool *handlerPool = nullptr;
+
+    HandlerOrdering handlerOrdering = HandlerOrdering::PerAction;
+
+    // Don't run onAction() at all when an action comes in, queue it until the game calls poll() on
+    // its own thread, so handlers can touch game state without locks.  Takes precedence over the pool.
+    bool dispatchOnPoll = false;
+
+    // Do the socket I/O through io_uring (Linux, needs the SDK built with SIMPLEWS_WITH_URING and
+    // liburing linked).  Works with both the receive thread and the event loop.
+    bool useIoUring = false;
+
+    // Print every JSON command sent and every text frame received to stdout, for debugging.  Each
+    // one is a flushed write on whichever thread sends or receives, so leave it off in a game.
+    bool logTraffic = false;
+};
 
 class Action {
     public:
-        Action(std::string name, std::string description, json schema = {}): name(name), description(description), jSchema(schema){}
+        Action(std::string name, std::string description, json schema = {}): name(name), description(description), jSchema(schema), nameHash(hashName(this->name)){}
         virtual ~Action() {};
 
         // Not normally a fan of getters and setters in c++ but we will need a modicum of thread safety
         std::string& GetName() { return name; };
         std::string& GetDescription() { return description; };
         json& GetSchema() { return jSchema; };  // Getter for JSON schema
-        void SetName(std::string newName) { name = newName; };
+        // Rename only while unregistered, the registry finds actions by name
+        void SetName(std::string newName) { name = newName; nameHash = hashName(name); };
         void SetDescription(std::string newDescription) { description = newDescription; };
         void SetSchema(std::string newSchema) { jSchema = json::parse(newSchema); };  // Setter for JSON schema
         void SetSchema(json newSchema) { jSchema = newSchema; };
@@ -42,20 +166,67 @@ class Action {
         // operator json, return the JSON representation of this Action object
         operator json() { return toJSON(); };  // Allows for implicit conversion to json
 
+        static size_t hashName(std::string_view actionName) { return std::hash<std::string_view>{}(actionName); }
+
     protected:
         friend class NeuroSDK;
+        friend struct ActionKey;
         std::string name;
         std::string description;
         json jSchema;
+        size_t nameHash;  // Worked out once, so a lookup only hashes the incoming name
+};
+
+// Registry key: a view of the action's own name plus its hash.  Looking an action up just needs a
+// key for the incoming name (a string_view, nothing copied), the stored side is never rehashed.
+struct ActionKey {
+    std::string_view name;
+    size_t hash;
+
+    explicit ActionKey(const Action &action) : name(action.name), hash(action.nameHash) {}
+    explicit ActionKey(std::string_view actionName) : name(actionName), hash(Action::hashName(actionName)) {}
+
+    bool operator==(const ActionKey &other) const { return hash == other.hash && name == other.name; }
+};
+
+struct ActionKeyHash {
+    size_t operator()(const ActionKey &key) const { return key.hash; }
+};
+
+using ActionRegistry = ActionRegistryT<ActionKey, ActionKeyHash>;
+
+// A force waiting for Neuro to pick one of its actions.  The answer goes here instead of to the
+// action's onAction().  The coroutine side (ForceAwaiter) is in neuro-coroutine.h, this is only
+// the part the SDK needs to route answers, so it builds the same whatever the language version.
+struct PendingForce {
+    std::vector<std::string> actions;  // Names the force offered
+    json action;                       // The action command's data once answered, null if cancelled
+    PendingForce *next = nullptr;
+
+    // Called once, after action has been filled in
+    virtual void resume() = 0;
+
+protected:
+    ~PendingForce() = default;
 };
 
+class ForceAwaiter;
+class ForcedAction;
+class Executor;
+
 class NeuroSDK {
 public:
-    NeuroSDK(const std::string &gameName);
+    NeuroSDK(const std::string &gameName, const SDKOptions &options = SDKOptions());
     ~NeuroSDK();
     // Send the initial connection to the server (this also calls gameinit()) + start receive loop
     bool connect(const std::string &server);
 
+    // Connect, then send startup, register initialActions (in one message) and send initialContext
+    // (if not empty) straight after the upgrade, all in a single write.  Refused without connecting
+    // if any of the actions' names is taken.  On failure the actions are left unregistered and
+    // still belong to the caller.
+    bool connectAndStart(const std::string &server, const std::vector<Action*> &initialActions = {}, const std::string &initialContext = "", bool silent = true);
+
     // Unregister all of our actions and close the connection + stop our receive loop
     void disconnect();
 
@@ -65,6 +236,25 @@ public:
     // Register an action with Neuro
     bool registerAction(Action *action);
 
+    // Register a group of actions with a single actions/register message.  Names already taken
+    // are skipped; returns false if none were registered or the message couldn't be sent.
+    bool registerActions(const std::vector<Action*> &actions);
+    bool registerActions(Action *const *actions, size_t count);
+
+    // While one of these is alive, registerAction() and registerActions() calls (from any thread)
+    // are gathered up and sent as one actions/register when it goes out of scope, e.g. around
+    // loading a level.  Actions unregistered meanwhile are left out.  They can be nested, the
+    // outermost one sends.
+    class RegistrationBatch {
+    public:
+        explicit RegistrationBatch(NeuroSDK &sdk);
+        ~RegistrationBatch();
+        RegistrationBatch(const RegistrationBatch&) = delete;
+        RegistrationBatch& operator=(const RegistrationBatch&) = delete;
+    private:
+        NeuroSDK &sdk;
+    };
+
     // Unregister an action from Neuro 
     void unregisterAction(std::string actionName);
 
@@ -78,43 +268,224 @@ public:
     // slient if set will allow Neuro to respond to the message otherwise it's slient
     bool sendContext(std::string contextMessage, bool slient=true);
 
+    // With dispatchOnPoll set, run the actions that have come in since the last call on this thread
+    // and queue their results.  Stops after maxItems, or once timeBudget (if not zero) has run out,
+    // leaving the rest for next time.  Call it from one thread only, say once a frame; returns how
+    // many actions were run.
+    size_t poll(size_t maxItems = (std::numeric_limits<size_t>::max)(), std::chrono::microseconds timeBudget = std::chrono::microseconds(0));
+
+    // Hand an event loop connection over to another loop (which must be shared, see SDKOptions::eventLoop).
+    // Not possible with our own loop or with io_uring, whose receive belongs to the loop thread that
+    // armed it.  Called from one of our own handlers the move happens once that handler returns.
+    bool moveToLoop(EventLoop *target);
+
+    // Drops, merges and replacements made by the writer thread's queue so far, and what it holds now
+    OutboundStats outboundStats() { return outbound.statistics(); }
+
+    // The same for the commands held while reconnecting
+    OutboundStats heldStats() { return heldCommands.statistics(); }
+
+    // What the server agreed to on the current connection
+    WireFormat wireFormat() const { return wire; }
+
+    // Bytes before and after compression so far (all zero unless compression was negotiated)
+    simplews::DeflateStats compressionStats() const { return ws.deflate_stats(); }
+
+    // Round trip time of the link itself (not Neuro's thinking time) from ping/pong, needs pingInterval set.
+    // Smoothed the same way TCP does it; negative until the first pong has come back.
+    std::chrono::microseconds smoothedRTT() const;
+    std::chrono::microseconds lastRTT() const;
+    // Mean deviation of the RTT samples
+    std::chrono::microseconds rttJitter() const;
+
     // Force a decsion from Neuro based on the list of registered actions
     // gamestate is what is currently happening, e.g. "the game is still under way"
     // whatToDo is what we want Neuro to do, e.g. "Its your turn, please make a move"
     bool forceAction( std::string gameState, std::string whatToDo, std::vector<std::string> listOfActions );
 
+    // co_await sdk.force(...) (C++20), see neuro-coroutine.h
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    ForceAwaiter force(std::string gameState, std::string whatToDo, std::vector<std::string> listOfActions, Executor *executor = nullptr);
+#endif
+
     // Disallow copy and asignment operators
     NeuroSDK(const NeuroSDK&) = delete;
     NeuroSDK& operator=(const NeuroSDK&) = delete;
    
 private:
+    friend class ForceAwaiter;
+    friend class ForcedAction;
+
     // Our game name
     std::string gameName;
 
+    SDKOptions options;
+
     // Are we connected?
-    bool isConnected;
+    std::atomic_bool isConnected;
+
+    // Actions that are currently registered, by name.  We own (and eventually delete) them; the
+    // game thread can change it while incoming actions are dispatched from it without a lock.
+    ActionRegistry registeredActions{ [](Action *action) { delete action; } };
+
+    // Add to the registry, false if an action by that name is already there
+    bool addAction(Action *action);
 
-    // Array of actions that are currently registered
-    std::vector<Action*> registeredActions;  // TODO: Replace with an unordered_set for faster lookups.
+    // Send one actions/register for actions already in the registry
+    bool announceActions(const std::vector<Action*> &actions);
+    bool holdForBatch(const std::vector<Action*> &actions);
+
+    // Registrations held back by a RegistrationBatch
+    std::mutex batchMutex;
+    int batchDepth = 0;
+    std::vector<Action*> batchedActions;
 
     // Send a RAW string to the server
     bool send(const std::string &message);
 
-    // Get a RAW string from the server
-    bool receive(std::string *output);
+    // Get the next message from the server, only valid until the next receive
+    bool receive(WebSocket::Message *output);
    
     // Send a JSON command to the server
     bool sendCommand(const json &command);
+    bool sendCommand(const json &command, CommandKind kind);
+
+    // A command in the negotiated wire format, and the kind of frame it goes in
+    std::string encode(const json &command) const;
+    json decode(std::string_view message, WebSocket::Opcode opcode) const;
+    WebSocket::Opcode wireOpcode() const;
+
+    json contextCommand(const std::string &contextMessage, bool silent);
+    json forceCommand(std::string gameState, std::string whatToDo, std::vector<std::string> listOfActions);
 
-    // Action management
-    // Removes an action, returns true if an action is removed.  Returns false otherwise.
-    bool removeAction( const Action &action );
+    // Builds a single actions/register message covering all of the given actions
+    json registerCommand(const std::vector<Action*> &actions);
 
     void receiveLoop();
 
-    std::thread *receiveThread;
+    // Process a single message from the server, shared by the receive thread and the event loop
+    void handleMessage(std::string_view message, WebSocket::Opcode opcode = WebSocket::Opcode::TEXT);
+
+    // Run the action an action command names, returning the action/result to send back
+    json runAction(const json &data);
+
+    // Handler pool mode: the pool handlers run on (options.handlerPool or ownHandlers), and how
+    // many of our handlers it has yet to finish, which the destructor waits for
+    HandlerPool *handlers = nullptr;
+    std::unique_ptr<HandlerPool> ownHandlers;
+    std::mutex handlersMutex;
+    std::condition_variable handlersDone;
+    size_t handlersInFlight = 0;
+    void dispatchToPool(json data);
+    void waitForHandlers();
+
+    // Actions waiting for poll(), pushed by whichever thread receives
+    MpscQueue<json> polledActions;
+
+    // Forces being awaited, oldest first.  An incoming action goes to the oldest one that offered it.
+    std::mutex forceMutex;
+    PendingForce *firstForce = nullptr;
+    PendingForce *lastForce = nullptr;
+    std::atomic<size_t> forcesWaiting{ 0 };
+    void addPendingForce(PendingForce *force);
+    bool cancelPendingForce(PendingForce *force);
+    bool claimForce(json &data);
+    void cancelAllForces();
+
+    json resultCommand(const json &id, bool success, const std::string &message);
+
+    // Event loop mode
+    bool startEventLoop();
+    void stopEventLoop();
+    void joinLoopThread();
+    void onSocketEvent(uint32_t events);
+    void dropFromLoop();
+
+    void attachToLoop();
+
+    // Reconnecting
+    bool openConnection();
+    bool startConnection();
+    bool reconnect();
+    void connectionLost();
+    bool replayState();
+    bool sendOrHold(OutboundCommand command);
+    bool holdLocked(OutboundCommand command);
+    void stopReconnect();
+
+    // Writer thread mode
+    void writerLoop();
+    void stopWriter();
+
+    // The same queue drained by the event loop instead
+    bool writesOnLoop() const;
+    void postFlush();
+    void flushOutbound();
+    void writeQueued();
+    void watchWritable(bool enable);
+    void unwatch();
+
+    // Reconnecting on the event loop
+    void scheduleReconnect();
+    void startReconnectAttempt();
+    void cancelReconnect();
+
+    // Keepalive, returns false if the connection has gone quiet for too long
+    bool keepalive();
+    void keepaliveLoop();
+    void stopKeepalive();
+
+    std::thread *receiveThread = nullptr;
     std::atomic_bool stop = false;
 
+    // The loop driving us in event loop mode (either options.eventLoop or ownLoop).  Atomic because
+    // senders post to it while moveToLoop() may be switching it.
+    std::atomic<EventLoop*> loop{ nullptr };
+    std::unique_ptr<EventLoop> ownLoop;
+    std::thread *loopThread = nullptr;
+    uint64_t pingTimer = 0;
+
+    // Loop thread only: the socket is being watched, and for writability too (bytes are pending)
+    bool attached = false;
+    bool watchingWritable = false;
+    // A flush has been posted to the loop and hasn't started yet, so pushing needn't post another
+    std::atomic_bool flushPosted = false;
+
+    // The wire format negotiated for the current connection
+    std::atomic<WireFormat> wire{ WireFormat::Json };
+
+    // Where we connected to, for reconnecting
+    std::string serverUrl;
+    // gameinit() has been called, so a reconnect has to send startup again
+    std::atomic_bool startupSent = false;
+
+    // Wakes a receive thread waiting out its reconnect backoff
+    std::mutex reconnectMutex;
+    std::condition_variable reconnectWake;
+
+    // Event loop reconnects (loop thread only): the backoff timer, the current delay, and the attempt
+    // in progress.  The attempt's thread hands its result back with a task that checks cancelled first.
+    struct ReconnectAttempt {
+        std::thread thread;
+        std::atomic_bool cancelled = false;
+    };
+    uint64_t reconnectTimer = 0;
+    std::chrono::milliseconds reconnectBackoff{ 0 };
+    std::shared_ptr<ReconnectAttempt> reconnectAttempt;
+
+    // Commands waiting for the connection to come back
+    std::mutex heldMutex;
+    OutboundQueue heldCommands;
+
+    // The writer thread, sendCommand() queues into outbound for it (or for the event loop, see writeQueued())
+    std::thread *writerThread = nullptr;
+    OutboundQueue outbound;
+
+    // Pings the server when we have a receive thread rather than a loop to hang a timer on
+    std::thread *keepaliveThread = nullptr;
+    std::mutex keepaliveMutex;
+    std::condition_variable keepaliveWake;
+
     // The websocket connection object we use to talk to the server.
     WebSocket ws;
 };
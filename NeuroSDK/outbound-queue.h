@@ -0,0 +1,198 @@
+#pragma once
+// Commands waiting for the writer thread.
+//
+// Any number of threads push, a single writer takes everything queued in one go.  Pushing only
+// takes a short lock and appends to a vector; the writer swaps the whole vector out, so it never
+// holds the lock while it talks to the socket.
+//
+// The queue is bounded so a stalled link can't grow it forever, but pushing never blocks: once it
+// is full room is made by giving up on whatever matters least.  Silent contexts are dropped
+// (oldest first) or merged, an unsent force is replaced by a newer one unless a coroutine is
+// waiting on its answer, and everything else (results above all) is always kept, even past the limit.
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace neuro {
+
+// What a queued message is, so a failed send knows whether it is worth holding on to
+enum class CommandKind {
+    Startup,
+    Context,
+    SilentContext,
+    Register,
+    Unregister,
+    Force,
+    AwaitedForce,  // A force a coroutine waits on, never replaced: its answer would go to the wrong one
+    Result,
+    Other
+};
+
+struct OutboundCommand {
+    CommandKind kind;
+    std::string message;
+    std::string text;  // A silent context's message, kept for merging
+};
+
+// What to do with a silent context when the queue is full
+enum class OverflowPolicy {
+    DropOldest,  // Drop the oldest queued silent context to make room
+    Merge        // Fold it into the newest queued silent context
+};
+
+struct OutboundStats {
+    uint64_t contextsDropped = 0;
+    uint64_t contextsMerged = 0;
+    uint64_t forcesReplaced = 0;
+    uint64_t highWaterCrossings = 0;
+    size_t queued = 0;
+};
+
+class OutboundQueue {
+public:
+    // Combines a newer silent context into an older one (which it rewrites)
+    using Merger = std::function<void(OutboundCommand &older, const OutboundCommand &newer)>;
+    using HighWaterCallback = std::function<void(size_t queued)>;
+
+    // Full at limit commands.  onHighWater is called (from the pushing thread, outside the lock)
+    // each time the queue grows past highWater, and again only after it has been emptied.
+    void configure(size_t limit, size_t highWater, OverflowPolicy policy, Merger merger, HighWaterCallback onHighWater) {
+        std::lock_guard<std::mutex> lock(mutex);
+        maxItems = limit;
+        highWaterMark = highWater;
+        overflow = policy;
+        merge = std::move(merger);
+        highWaterCallback = std::move(onHighWater);
+    }
+
+    // Queue a command, returns false once the queue has been closed
+    bool push(OutboundCommand command) {
+        bool wake;
+        size_t crossedAt = 0;
+        HighWaterCallback callback;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (closed) return false;
+
+            if (command.kind == CommandKind::Force || command.kind == CommandKind::AwaitedForce) {
+                // Only the newest force still means anything
+                auto older = std::find_if(items.begin(), items.end(), [](const OutboundCommand &item) { return item.kind == CommandKind::Force; });
+                if (older != items.end()) {
+                    items.erase(older);
+                    stats.forcesReplaced++;
+                }
+            }
+            if (maxItems > 0 && items.size() >= maxItems && !makeRoom(command)) {
+                return true;  // Merged into one already queued
+            }
+            items.push_back(std::move(command));
+
+            if (highWaterMark > 0 && items.size() > highWaterMark && !aboveHighWater) {
+                aboveHighWater = true;
+                stats.highWaterCrossings++;
+                crossedAt = items.size();
+                callback = highWaterCallback;
+            }
+            wake = consumerWaiting;
+        }
+        // Only pay for the notify when the writer is actually asleep
+        if (wake) ready.notify_one();
+        if (crossedAt && callback) callback(crossedAt);
+        return true;
+    }
+
+    OutboundStats statistics() {
+        std::lock_guard<std::mutex> lock(mutex);
+        OutboundStats snapshot = stats;
+        snapshot.queued = items.size();
+        return snapshot;
+    }
+
+    // Wait for commands and move all of them into out (which should be empty).
+    // Returns false once the queue is closed and everything in it has been taken.
+    bool popAll(std::vector<OutboundCommand> &out) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (items.empty() && !closed) {
+            consumerWaiting = true;
+            ready.wait(lock);
+            consumerWaiting = false;
+        }
+        if (items.empty()) return false;
+        out.swap(items);
+        aboveHighWater = false;
+        return true;
+    }
+
+    // Move whatever is queued into out without waiting, false if there was nothing
+    bool takeAll(std::vector<OutboundCommand> &out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.empty()) return false;
+        out.swap(items);
+        aboveHighWater = false;
+        return true;
+    }
+
+    // Stop accepting commands; the writer still gets whatever was queued before this
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        ready.notify_all();
+    }
+
+    // Accept commands again (for the next connect())
+    void reopen() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = false;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        items.clear();
+        aboveHighWater = false;
+    }
+
+private:
+    // The queue is full and command is about to go in.  Returns false if command was merged away.
+    bool makeRoom(const OutboundCommand &command) {
+        auto silent = [](const OutboundCommand &item) { return item.kind == CommandKind::SilentContext; };
+        if (command.kind == CommandKind::SilentContext && overflow == OverflowPolicy::Merge && merge) {
+            auto newest = std::find_if(items.rbegin(), items.rend(), silent);
+            if (newest != items.rend()) {
+                merge(*newest, command);
+                stats.contextsMerged++;
+                return false;
+            }
+        }
+        auto oldest = std::find_if(items.begin(), items.end(), silent);
+        if (oldest != items.end()) {
+            items.erase(oldest);
+            stats.contextsDropped++;
+        }
+        // Otherwise nothing can go, so we grow past the limit rather than lose it
+        return true;
+    }
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::vector<OutboundCommand> items;
+    bool consumerWaiting = false;
+    bool closed = false;
+
+    size_t maxItems = 0;  // 0 for no limit
+    size_t highWaterMark = 0;
+    bool aboveHighWater = false;
+    OverflowPolicy overflow = OverflowPolicy::DropOldest;
+    Merger merge;
+    HighWaterCallback highWaterCallback;
+    OutboundStats stats;
+};
+
+}
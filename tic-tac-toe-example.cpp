@@ -14,6 +14,14 @@ const char* appName = "tic-tac-toe";
 
 class TicTacToeDemo;
 
+// The engine's state may only be touched from its own thread, so Neuro's moves are queued and
+// run from OnUserUpdate (see neurosdk.poll()) rather than on the SDK's receive thread
+SDKOptions sdkOptions() {
+    SDKOptions options;
+    options.dispatchOnPoll = true;
+    return options;
+}
+
 // Action to handle "play" actions from NeuroSDK
 class playAction : public neuro::Action {
 public:
@@ -30,7 +38,7 @@ private:
 class TicTacToeDemo : public olc::PixelGameEngine
 {
 public:
-	TicTacToeDemo() : neurosdk(appName),
+	TicTacToeDemo() : neurosdk(appName, sdkOptions()),
             cellNames({ "top left",    "top middle",    "top right",
                         "middle left", "middle middle", "middle right",
                         "bottom left", "bottom middle", "bottom right" })
@@ -55,14 +63,12 @@ public:
     // Called once at the start of the program
 	bool OnUserCreate() override
 	{
-        if (!neurosdk.connect("localhost:8000")){
+        // startup goes out with the upgrade, so there is no need to wait before the rules below
+        if (!neurosdk.connectAndStart("localhost:8000")){
             std::cerr << "Failed to connect to Neuro" << std::endl;
             return false;
         }
 
-        neurosdk.gameinit();
-        Sleep(100);
-
         InitBoard();
         DrawBoard();
 
@@ -246,6 +252,9 @@ public:
 
 	bool OnUserUpdate(float fElapsedTime) override
 	{
+        // Run any moves Neuro has sent, between frames so they never land mid-draw
+        neurosdk.poll(8, std::chrono::milliseconds(2));
+
         if( !gameOver && GetMouse(0).bPressed )
         {
             int x = GetMouseX() / 100;